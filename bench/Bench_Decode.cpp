@@ -0,0 +1,147 @@
+// throughput of the decoding steps, in GB/s of input. base64 and value
+// conversion run on synthetic data, inflating on the zlib-compressed binary
+// arrays of the mzML file given as argument.
+// build in release mode for meaningful numbers.
+
+#include "Base64.h"  // internal header
+#include "Convert.h"  // internal header
+#include "Decompress.h"  // internal header
+#include "MappedFile.h"  // internal header
+#include "TagSearch.h"  // internal header
+extern "C" {
+#include <b64/cdecode.h>
+}
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// best of a few runs, in GB/s of input_size
+static double Measure(size_t input_size, const std::function<void()>& run) {
+    const int kRuns = 5;
+    double best_seconds = 1e30;
+    for (int i = 0; i < kRuns; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        if (elapsed.count() < best_seconds) { best_seconds = elapsed.count(); }
+    }
+    return input_size / best_seconds / 1e9;
+}
+
+static std::string RandomBase64(size_t size, size_t line_length) {
+    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string text;
+    text.reserve(size + size / 64);
+    srand(1);
+    for (size_t i = 0; i < size; ++i) {
+        text += alphabet[rand() % 64];
+        if (line_length != 0 && i % line_length == line_length - 1) { text += '\n'; }
+    }
+    return text;
+}
+
+static void BenchBase64() {
+    const size_t kSize = 64 * 1024 * 1024;
+    struct Input { const char* name; std::string text; };
+    std::vector<Input> inputs = {{"plain", RandomBase64(kSize, 0)}, {"76-column lines", RandomBase64(kSize, 76)}};
+    const struct { const char* name; Base64Kernel kernel; } kernels[] = {
+        {"scalar", Base64Kernel::kScalar}, {"sse4.1", Base64Kernel::kSse41},
+        {"avx2", Base64Kernel::kAvx2}, {"avx512 vbmi", Base64Kernel::kAvx512Vbmi}};
+    for (auto& input : inputs) {
+        std::vector<char> output(input.text.size() / 4 * 3 + 1);
+        printf("base64, %s:\n", input.name);
+        printf("  %-12s %6.2f GB/s\n", "libb64", Measure(input.text.size(), [&] {
+            base64_decodestate state;
+            base64_init_decodestate(&state);
+            base64_decode_block(input.text.data(), input.text.size(), output.data(), &state);
+        }));
+        for (auto& kernel : kernels) {
+            if (!IsBase64KernelSupported(kernel.kernel)) { continue; }
+            printf("  %-12s %6.2f GB/s\n", kernel.name, Measure(input.text.size(), [&] {
+                DecodeBase64(input.text.data(), input.text.size(), output.data(), kernel.kernel);
+            }));
+        }
+    }
+}
+
+// the per-byte copy loop that DecodeMzData used before
+static void ConvertValuesBytewise(const char* data, size_t count, int precision, bool little_endian, double* out) {
+    auto step_size = precision / 8;
+    for (size_t i = 0; i < count; ++i) {
+        char bytes[8];
+        for (auto j = 0; j < step_size; ++j) {
+            bytes[j] = little_endian ? data[i * step_size + j] : data[i * step_size + step_size - 1 - j];
+        }
+        if (precision == 64) { memcpy(&out[i], bytes, 8); }
+        else { float value; memcpy(&value, bytes, 4); out[i] = value; }
+    }
+}
+
+static void BenchConvert() {
+    const size_t kCount = 16 * 1024 * 1024;
+    std::vector<char> data(kCount * 8);
+    for (size_t i = 0; i < data.size(); ++i) { data[i] = static_cast<char>(i * 131 % 251); }
+    std::vector<double> output(kCount);
+    for (int precision : {64, 32}) {
+        for (bool little_endian : {true, false}) {
+            auto input_size = kCount * precision / 8;
+            printf("conversion, %d bit %s endian:\n", precision, little_endian ? "little" : "big");
+            printf("  %-12s %6.2f GB/s\n", "bytewise", Measure(input_size, [&] {
+                ConvertValuesBytewise(data.data(), kCount, precision, little_endian, output.data());
+            }));
+            printf("  %-12s %6.2f GB/s\n", "scalar", Measure(input_size, [&] {
+                ConvertValues(data.data(), kCount, precision, little_endian, output.data(), ConvertKernel::kScalar);
+            }));
+            if (IsConvertKernelSupported(ConvertKernel::kAvx2)) {
+                printf("  %-12s %6.2f GB/s\n", "avx2", Measure(input_size, [&] {
+                    ConvertValues(data.data(), kCount, precision, little_endian, output.data(), ConvertKernel::kAvx2);
+                }));
+            }
+        }
+    }
+}
+
+static void BenchInflate(const char* filename) {
+    // decoded payloads of all binary elements that hold a zlib stream
+    struct Payload { std::vector<char> data; unsigned long plain_size; };
+    std::vector<Payload> payloads;
+    MappedFile file(filename);
+    auto text_end = file.data() + file.size();
+    size_t compressed_size = 0;
+    for (auto cursor = FindStartTag(file.data(), text_end, "binary"); cursor != nullptr;
+            cursor = FindStartTag(cursor + 1, text_end, "binary")) {
+        auto value_begin = static_cast<const char*>(memchr(cursor, '>', text_end - cursor)) + 1;
+        auto value_end = static_cast<const char*>(memchr(value_begin, '<', text_end - value_begin));
+        Payload payload;
+        payload.data.resize((value_end - value_begin + 3) / 4 * 3);
+        payload.data.resize(decode(value_begin, static_cast<int>(value_end - value_begin), payload.data.data()));
+        if (payload.data.size() < 2 || (payload.data[0] & 0x0F) != 8) { continue; }  // not zlib
+        ScratchBuffer<char> plain;
+        payload.plain_size = decompress(payload.data.data(), payload.data.size(), 0, plain, InflateBackend::kZlib);
+        compressed_size += payload.data.size();
+        payloads.push_back(std::move(payload));
+    }
+    printf("inflate, %zu arrays of %s:\n", payloads.size(), filename);
+    if (payloads.empty()) { return; }
+    const struct { const char* name; InflateBackend backend; } backends[] = {
+        {"zlib", InflateBackend::kZlib}, {"one-shot", InflateBackend::kOneShot}};
+    for (auto& backend : backends) {
+        ScratchBuffer<char> plain;
+        printf("  %-12s %6.2f GB/s\n", backend.name, Measure(compressed_size, [&] {
+            for (auto& payload : payloads) {
+                decompress(payload.data.data(), payload.data.size(), payload.plain_size, plain, backend.backend);
+            }
+        }));
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchBase64();
+    BenchConvert();
+    if (argc > 1) { BenchInflate(argv[1]); }
+    return 0;
+}
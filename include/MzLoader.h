@@ -18,17 +18,21 @@
 
 // TODO: remove some useless fields, like total ion current
 // TODO: cover all possible big endian data setting
-// TODO: add filters: 1. charge filter, 2. mass filter, 3. ms level filter
 
 #include <vector>
 #include <memory>
+#include <limits>
+#include <utility>
+#include <iterator>
+#include <cstddef>
 
 class MzLoader {
 public:
     typedef double Mass;
     typedef double Intensity;
 
-    struct Spectrum {
+    // everything about a spectrum but its peaks
+    struct SpectrumHeader {
         unsigned scan_num;
         unsigned ms_level;
         unsigned precursor_charge;
@@ -36,17 +40,283 @@ public:
         double base_peak_mz;
         double base_peak_intensity;
         double total_ion_current;
+        // byte offset of the spectrum element in the file, which restores file
+        // order for spectra that were delivered out of order.
+        size_t file_offset;
+    };
+
+    struct Spectrum : SpectrumHeader {
         std::vector< std::pair<Mass, Intensity> > peaks;
     };
 
+    // the peaks as separate m/z and intensity arrays, in float or double.
+    // floats halve the memory and lose nothing for data stored in 32 bits.
+    template <typename MzValue, typename IntensityValue = MzValue>
+    struct SpectrumArrays : SpectrumHeader {
+        std::vector<MzValue> mz;
+        std::vector<IntensityValue> intensity;
+    };
+
+    // the peaks left where the loader decoded them, for reading them once
+    // without a copy. the i-th peak is mz[i * stride] and
+    // intensity[i * stride]. they are valid until the next LoadNext or
+    // LoadScan of the same loader.
+    struct SpectrumView : SpectrumHeader {
+        const Mass* mz;
+        const Intensity* intensity;
+        size_t size;
+        size_t stride;
+    };
+
+    // several spectra with the peaks of all of them in one pair of arrays,
+    // one spectrum after the other. the peaks of the i-th spectrum are
+    // mz[j] and intensity[j] for peak_starts[i] <= j < peak_starts[i + 1].
+    struct SpectrumBatch {
+        std::vector<SpectrumHeader> headers;
+        std::vector<Mass> mz;
+        std::vector<Intensity> intensity;
+        std::vector<size_t> peak_starts;  // one more than headers
+    };
+
+    // a header and the number of peaks of the spectrum
+    struct SpectrumSummary : SpectrumHeader {
+        size_t peak_count;
+    };
+
+    // room for peaks in memory of the caller, e.g. a row of its own matrix
+    struct PeakSink {
+        Mass* mz;
+        Intensity* intensity;
+        size_t capacity;
+    };
+
+    // receives the spectra of ForEach
+    class Visitor {
+    public:
+        virtual ~Visitor() {}
+        // where the peaks of the spectrum go, asked for once its header is
+        // read and before its peaks are decoded.
+        virtual PeakSink Place(const SpectrumHeader& header) = 0;
+        // the spectrum placed last turned out to be broken, so it is never
+        // visited. the place is free again and may be handed out anew.
+        virtual void Discard(const SpectrumHeader& header) { (void)header; }
+        // the spectrum is complete, with peak_count peaks at the start of
+        // the sink. kept_count is the number of peaks the filter kept; if
+        // it is larger, the sink was too small and the rest were dropped.
+        // filter.top_n can keep the most intense ones instead.
+        virtual void Visit(const SpectrumHeader& header, size_t peak_count, size_t kept_count) = 0;
+    };
+
+    // which spectra the loader returns, and which of their peaks. the checks
+    // of spectra run on the header of each spectrum, so the peaks of a
+    // spectrum that fails them are not decoded. the peak checks run while the
+    // peaks are decoded, and only the peaks that pass are stored. the
+    // defaults let all ms2 spectra and all their peaks through.
+    struct Filter {
+        // spectra of ms level 2 and up without a precursor are never
+        // returned. ms1 spectra have none, so their precursor_charge and
+        // precursor_mz are 0, and min_charge or a precursor mass above 0
+        // leaves none of them.
+        unsigned ms_level = 2;
+        unsigned min_charge = 0;
+        unsigned max_charge = std::numeric_limits<unsigned>::max();
+        // neutral mass of the precursor in Da, (m/z - proton) * charge
+        double min_precursor_mass = 0;
+        double max_precursor_mass = std::numeric_limits<double>::infinity();
+        unsigned min_scan_num = 0;
+        unsigned max_scan_num = std::numeric_limits<unsigned>::max();
+        // peaks outside the m/z window or below min_intensity are dropped,
+        // then all but the top_n most intense, unless top_n is 0. the window
+        // is found by binary search, assuming peaks sorted by m/z as mzML
+        // and mzXML store them.
+        double min_mz = 0;
+        double max_mz = std::numeric_limits<double>::infinity();
+        double min_intensity = 0;
+        size_t top_n = 0;
+    };
+
+    struct LoadOptions {
+        // parse mzML one <spectrum> element at a time instead of building a
+        // DOM of the whole document. memory is then bounded by the largest
+        // spectrum and the first spectrum is available right away. mzXML
+        // files are always parsed as a whole.
+        bool streaming = false;
+        // keep an index of all spectra next to the input, in
+        // "<filename>.mzlidx". it is written on the first open and reused as
+        // long as size and modification time of the input match, so later
+        // opens go straight to the first spectrum and LoadNext skips other
+        // ms levels without parsing them.
+        bool use_index_file = false;
+        // threads the loader may use, 0 for one per hardware thread. with
+        // more than one, LoadNext decodes spectra on a pool of workers and
+        // still returns them in file order (nested mzXML scans come right
+        // after their parent), and files without an index are indexed for
+        // LoadScan by scanning byte ranges of the file in parallel.
+        unsigned num_threads = 1;
+        // with worker threads, hand out each spectrum as soon as it is
+        // decoded instead of in file order. a slow spectrum then no longer
+        // holds back the ones behind it.
+        bool ordered_delivery = true;
+        // applies to LoadNext and LoadScan alike
+        Filter filter;
+        // turn profile spectra into centroided ones while decoding, on the
+        // worker threads if there are any. each peak of the profile gives one
+        // peak at its interpolated apex with its summed intensity. the peak
+        // checks of the filter apply to the centroids.
+        bool centroid = false;
+    };
+
     MzLoader(const char* filename);
+    MzLoader(const char* filename, const LoadOptions& options);
     ~MzLoader();
 
     // return whether next valid spectrum exists.
-    // parameter buffer is for output.
+    // parameter buffer is for output. its peaks are overwritten in place, so
+    // a caller that loops with one buffer stops allocating once the buffer
+    // has held the largest spectrum.
     bool LoadNext(Spectrum& buffer);
 
+    // load the spectrum with the given scan number without walking the file,
+    // using the offset index of indexedmzML/mzXML when there is one. the same
+    // checks as LoadNext apply, so it returns false for e.g. ms1 scans.
+    // it does not change the position of LoadNext, and as long as LoadNext is
+    // not called the document is never parsed as a whole.
+    bool LoadScan(unsigned scan_num, Spectrum& buffer);
+
+    // the same for the array layout, for MzValue and IntensityValue of float
+    // or double. the arrays are reused in place like the peaks above.
+    template <typename MzValue, typename IntensityValue>
+    bool LoadNext(SpectrumArrays<MzValue, IntensityValue>& buffer);
+    template <typename MzValue, typename IntensityValue>
+    bool LoadScan(unsigned scan_num, SpectrumArrays<MzValue, IntensityValue>& buffer);
+
+    // and for views, see SpectrumView for how long they stay valid.
+    bool LoadNext(SpectrumView& view);
+    bool LoadScan(unsigned scan_num, SpectrumView& view);
+
+    // load the next count spectra into batch, or as many as are left, and
+    // return how many. the arrays of the batch are reused in place, so
+    // loading batch after batch into one stops allocating once the batch has
+    // held the largest.
+    size_t LoadBatch(size_t count, SpectrumBatch& batch);
+
+    // LoadNext without the peaks, for passes that only need the headers. the
+    // same spectra are returned, each with the number of peaks the file
+    // states for it (defaultArrayLength in mzML, peaksCount in mzXML), which
+    // is before the peak checks of the filter and centroiding. the params of
+    // the peak arrays are checked as for decoding, but the data itself is
+    // not, so only arrays whose decoded lengths differ slip through. the
+    // peaks are only decoded, and then counted as LoadNext returns them, if
+    // the file leaves the number out. it walks the file on a position of its
+    // own and never on worker threads, so the headers and counts are the
+    // same whether or not LoadNext has been called.
+    bool LoadNextHeader(SpectrumSummary& summary);
+
+    // the spectra LoadNext would return, each decoded into the sink the
+    // visitor places it in, as far as the arrays fit there, so that they
+    // are neither copied out of loader buffers nor paired up. it returns
+    // the number of spectra visited.
+    size_t ForEach(Visitor& visitor);
+
+    // the spectra of LoadNext as a range, for
+    //   for (auto& spectrum : loader) { ... }
+    // every iterator refers to one buffer of the loader, which each
+    // increment reloads in place. a spectrum worth keeping is moved out of
+    // it, std::move(*it), which hands over the peaks without a copy and
+    // leaves the buffer to allocate anew. begin() goes on from where
+    // LoadNext is.
+    class Iterator {
+    public:
+        typedef std::input_iterator_tag iterator_category;
+        typedef Spectrum value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef Spectrum* pointer;
+        typedef Spectrum& reference;
+
+        Iterator() {}  // the end
+        Iterator(MzLoader& loader, Spectrum& buffer) : loader_(&loader), buffer_(&buffer) { ++*this; }
+
+        Spectrum& operator*() const { return *buffer_; }
+        Spectrum* operator->() const { return buffer_; }
+        Iterator& operator++() {
+            if (!loader_->LoadNext(*buffer_)) { loader_ = nullptr; }
+            return *this;
+        }
+        bool operator==(const Iterator& other) const { return loader_ == other.loader_; }
+        bool operator!=(const Iterator& other) const { return loader_ != other.loader_; }
+
+    private:
+        MzLoader* loader_ = nullptr;
+        Spectrum* buffer_ = nullptr;
+    };
+
+    Iterator begin();
+    Iterator end() { return Iterator(); }
+
+    // convert the spectra LoadNext returns for options into a cache, a
+    // binary file with the header table and the decoded peaks of all of them
+    // (".mzlcache" by convention). a loader opened on a cache, under any
+    // name, maps it and returns its spectra without parsing or decoding.
+    // the filter of the loader still applies, centroid does not. the cache
+    // is in the byte order of this machine.
+    static void WriteCache(const char* filename, const char* cache_filename);
+    static void WriteCache(const char* filename, const char* cache_filename, const LoadOptions& options);
+
 private:
     class Impl;
     std::unique_ptr<Impl> pImpl;
+
+    friend class ConcurrentMzLoader;
+};
+
+// a loader whose LoadNext may be called from any number of threads at once,
+// e.g. by search workers that each pull the next spectrum. spectra are decoded
+// on options.num_threads workers into a bounded queue, so the consumers never
+// wait on each other for parsing. with options.ordered_delivery turned off
+// they are handed out in the order they finish decoding.
+class ConcurrentMzLoader {
+public:
+    ConcurrentMzLoader(const char* filename, const MzLoader::LoadOptions& options);
+    ~ConcurrentMzLoader();
+
+    // thread-safe, otherwise the same as MzLoader::LoadNext.
+    bool LoadNext(MzLoader::Spectrum& buffer);
+    template <typename MzValue, typename IntensityValue>
+    bool LoadNext(MzLoader::SpectrumArrays<MzValue, IntensityValue>& buffer);
+    // the spectra of a batch may be interleaved with those of other threads
+    size_t LoadBatch(size_t count, MzLoader::SpectrumBatch& batch);
+
+private:
+    std::unique_ptr<MzLoader::Impl> pImpl;
+};
+
+// the spectra of a file sorted by the neutral mass of their precursor, for
+// searches that only decode the spectra within a mass tolerance. it is built
+// from one pass of LoadNextHeader with options, so the spectrum checks of
+// their filter apply, and takes 24 bytes per spectrum. the spectra of a
+// range are then loaded by scan number, e.g.
+//   auto range = index.Find(mass - tolerance, mass + tolerance);
+//   for (auto entry = range.first; entry != range.second; ++entry) {
+//       loader.LoadScan(entry->scan_num, spectrum);
+//   }
+class PrecursorIndex {
+public:
+    struct Entry {
+        double precursor_mass;  // (m/z - proton) * charge, as in MzLoader::Filter
+        unsigned precursor_charge;
+        unsigned scan_num;
+        size_t file_offset;
+    };
+
+    PrecursorIndex(const char* filename);
+    PrecursorIndex(const char* filename, const MzLoader::LoadOptions& options);
+
+    // the entries with min_mass <= precursor_mass <= max_mass, in mass order
+    std::pair<const Entry*, const Entry*> Find(double min_mass, double max_mass) const;
+
+    size_t size() const { return entries_.size(); }
+    const Entry& operator[](size_t i) const { return entries_[i]; }
+
+private:
+    std::vector<Entry> entries_;  // by mass, then file order
 };
@@ -1,12 +1,219 @@
 #pragma once
 
-extern "C" {
-#include <b64/cdecode.h>
+#include <array>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MZLOADER_BASE64_SIMD
+#define MZLOADER_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// base64 decoding. the vector kernels decode whole registers of base64 text
+// at a time and hand over to the scalar code at the first register that
+// holds a character outside the alphabet, such as a line break or the '='
+// padding. like libb64, the scalar code skips those characters, so both give
+// the same result for any input. the kernel is chosen once, by what the cpu
+// supports.
+
+enum class Base64Kernel { kScalar, kSse41, kAvx2, kAvx512Vbmi };
+
+// value of each base64 character, 0x80 for characters that are skipped
+inline const unsigned char* Base64Table() {
+    static const auto table = [] {
+        std::array<unsigned char, 256> table;
+        table.fill(0x80);
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        for (unsigned char i = 0; i < 64; ++i) { table[static_cast<unsigned char>(alphabet[i])] = i; }
+        return table;
+    }();
+    return table.data();
+}
+
+// decode groups of four characters until the cursor is at or past stop.
+// a group cut short by the end of the text yields the bytes it completes.
+inline void DecodeBase64Groups(const char** cursor, const char* end, const char* stop, char** out) {
+    auto table = Base64Table();
+    auto in = reinterpret_cast<const unsigned char*>(*cursor);
+    auto in_end = reinterpret_cast<const unsigned char*>(end);
+    auto in_stop = reinterpret_cast<const unsigned char*>(stop);
+    auto o = reinterpret_cast<unsigned char*>(*out);
+    while (in < in_end && in < in_stop) {
+        if (in_end - in >= 4) {
+            unsigned a = table[in[0]], b = table[in[1]], c = table[in[2]], d = table[in[3]];
+            if (((a | b | c | d) & 0x80) == 0) {
+                o[0] = static_cast<unsigned char>(a << 2 | b >> 4);
+                o[1] = static_cast<unsigned char>(b << 4 | c >> 2);
+                o[2] = static_cast<unsigned char>(c << 6 | d);
+                in += 4;
+                o += 3;
+                continue;
+            }
+        }
+        unsigned sextets[4];
+        int count = 0;
+        while (count < 4 && in < in_end) {
+            auto value = table[*in++];
+            if (value < 64) { sextets[count++] = value; }
+        }
+        if (count >= 2) { *o++ = static_cast<unsigned char>(sextets[0] << 2 | sextets[1] >> 4); }
+        if (count >= 3) { *o++ = static_cast<unsigned char>(sextets[1] << 4 | sextets[2] >> 2); }
+        if (count == 4) { *o++ = static_cast<unsigned char>(sextets[2] << 6 | sextets[3]); }
+    }
+    *cursor = reinterpret_cast<const char*>(in);
+    *out = reinterpret_cast<char*>(o);
+}
+
+#ifdef MZLOADER_BASE64_SIMD
+// the vector kernels below stop two registers before the end of the text, so
+// that their full-width stores stay inside the output buffer.
+
+// sse and avx2 translate characters with nibble lookups (Muła and Lemire,
+// "Faster Base64 Encoding and Decoding using AVX2 Instructions"), then pack
+// four sextets into three bytes with multiply-adds.
+MZLOADER_TARGET("sse4.1")
+inline void DecodeBase64BlocksSse41(const char** cursor, const char* end, char** out) {
+    const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                         0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                         0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2F);
+    const __m128i pack_shuffle = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    auto in = *cursor;
+    auto o = *out;
+    for (; end - in >= 32; in += 16, o += 12) {
+        auto text = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+        auto hi_nibbles = _mm_and_si128(_mm_srli_epi32(text, 4), mask_2f);
+        auto lo_nibbles = _mm_and_si128(text, mask_2f);
+        auto hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        auto lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm_testz_si128(lo, hi)) { break; }  // a character outside the alphabet
+        auto roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(text, mask_2f), hi_nibbles));
+        auto sextets = _mm_add_epi8(text, roll);
+        auto pairs = _mm_maddubs_epi16(sextets, _mm_set1_epi32(0x01400140));
+        auto triples = _mm_madd_epi16(pairs, _mm_set1_epi32(0x00011000));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(o), _mm_shuffle_epi8(triples, pack_shuffle));
+    }
+    *cursor = in;
+    *out = o;
+}
+
+MZLOADER_TARGET("avx2")
+inline void DecodeBase64BlocksAvx2(const char** cursor, const char* end, char** out) {
+    const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                            0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                            0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                              0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+    const __m256i pack_shuffle = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                  2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    const __m256i pack_lanes = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+    auto in = *cursor;
+    auto o = *out;
+    for (; end - in >= 64; in += 32, o += 24) {
+        auto text = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+        auto hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(text, 4), mask_2f);
+        auto lo_nibbles = _mm256_and_si256(text, mask_2f);
+        auto hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+        auto lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+        if (!_mm256_testz_si256(lo, hi)) { break; }
+        auto roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(text, mask_2f), hi_nibbles));
+        auto sextets = _mm256_add_epi8(text, roll);
+        auto pairs = _mm256_maddubs_epi16(sextets, _mm256_set1_epi32(0x01400140));
+        auto triples = _mm256_madd_epi16(pairs, _mm256_set1_epi32(0x00011000));
+        auto packed = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(triples, pack_shuffle), pack_lanes);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(o), packed);
+    }
+    *cursor = in;
+    *out = o;
+}
+
+// with vbmi, a two-register byte permute looks up all 128 ascii characters
+// at once, and another one packs the 48 output bytes.
+MZLOADER_TARGET("avx512f,avx512bw,avx512vbmi")
+inline void DecodeBase64BlocksAvx512Vbmi(const char** cursor, const char* end, char** out) {
+    auto table = Base64Table();
+    const __m512i lut_lo = _mm512_loadu_si512(table);
+    const __m512i lut_hi = _mm512_loadu_si512(table + 64);
+    alignas(64) static const auto pack_index = [] {
+        std::array<unsigned char, 64> index = {};
+        for (unsigned i = 0; i < 48; ++i) { index[i] = static_cast<unsigned char>(i / 3 * 4 + 2 - i % 3); }
+        return index;
+    }();
+    const __m512i pack_permute = _mm512_load_si512(pack_index.data());
+    auto in = *cursor;
+    auto o = *out;
+    for (; end - in >= 128; in += 64, o += 48) {
+        auto text = _mm512_loadu_si512(in);
+        auto sextets = _mm512_permutex2var_epi8(lut_lo, text, lut_hi);
+        // skipped characters have the top bit set in the table, non-ascii ones in the text
+        if (_mm512_movepi8_mask(_mm512_or_si512(sextets, text)) != 0) { break; }
+        auto pairs = _mm512_maddubs_epi16(sextets, _mm512_set1_epi32(0x01400140));
+        auto triples = _mm512_madd_epi16(pairs, _mm512_set1_epi32(0x00011000));
+        // the zero-masked permute, as the plain one trips -Wmaybe-uninitialized in gcc 12
+        _mm512_mask_storeu_epi8(o, 0x0000FFFFFFFFFFFFull, _mm512_maskz_permutexvar_epi8(~0ull, pack_permute, triples));
+    }
+    *cursor = in;
+    *out = o;
+}
+#endif
+
+inline bool IsBase64KernelSupported(Base64Kernel kernel) {
+    switch (kernel) {
+    case Base64Kernel::kScalar:
+        return true;
+#ifdef MZLOADER_BASE64_SIMD
+    case Base64Kernel::kSse41:
+        return __builtin_cpu_supports("sse4.1");
+    case Base64Kernel::kAvx2:
+        return __builtin_cpu_supports("avx2");
+    case Base64Kernel::kAvx512Vbmi:
+        return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vbmi");
+#endif
+    default:
+        return false;
+    }
 }
 
-// a customized wrapper of libb64 library
+inline Base64Kernel BestBase64Kernel() {
+    for (auto kernel : {Base64Kernel::kAvx512Vbmi, Base64Kernel::kAvx2, Base64Kernel::kSse41}) {
+        if (IsBase64KernelSupported(kernel)) { return kernel; }
+    }
+    return Base64Kernel::kScalar;
+}
+
+// decode with the given kernel, which must be supported. plaintext_out needs
+// room for (length_in + 3) / 4 * 3 bytes. returns the number of decoded bytes.
+inline int DecodeBase64(const char* code_in, const int length_in, char* plaintext_out, Base64Kernel kernel) {
+    auto table = Base64Table();
+    auto cursor = code_in;
+    auto end = code_in + length_in;
+    auto out = plaintext_out;
+    while (cursor < end) {
+        switch (kernel) {
+#ifdef MZLOADER_BASE64_SIMD
+        case Base64Kernel::kSse41: DecodeBase64BlocksSse41(&cursor, end, &out); break;
+        case Base64Kernel::kAvx2: DecodeBase64BlocksAvx2(&cursor, end, &out); break;
+        case Base64Kernel::kAvx512Vbmi: DecodeBase64BlocksAvx512Vbmi(&cursor, end, &out); break;
+#endif
+        default: DecodeBase64Groups(&cursor, end, end, &out); break;
+        }
+        // decode past the character the vectors stopped at, then try them again
+        auto skipped = cursor;
+        while (skipped < end && table[static_cast<unsigned char>(*skipped)] < 64) { ++skipped; }
+        DecodeBase64Groups(&cursor, end, skipped < end ? skipped + 1 : end, &out);
+    }
+    return static_cast<int>(out - plaintext_out);
+}
+
+// decode with the fastest kernel of this cpu
 inline int decode(const char* code_in, const int length_in, char* plaintext_out) {
-    base64_decodestate state;
-    base64_init_decodestate(&state);
-    return base64_decode_block(code_in, length_in, plaintext_out, &state);
-}
\ No newline at end of file
+    static const auto kernel = BestBase64Kernel();
+    return DecodeBase64(code_in, length_in, plaintext_out, kernel);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "MzLoader.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+
+// the binary cache format written by MzLoader::WriteCache. all sections are
+// 8-byte aligned arrays in native byte order, so a mapped cache is read in
+// place:
+//   CacheHeader
+//   m/z values of all spectra, one spectrum after the other (double)
+//   intensity values in the same order (double)
+//   CacheEntry of each spectrum
+//   index of the first peak of each spectrum, and the total (uint64_t)
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t spectrum_count;
+    uint64_t peak_count;
+    uint64_t mz_offset;
+    uint64_t intensity_offset;
+    uint64_t entries_offset;
+    uint64_t peak_starts_offset;
+};
+
+struct CacheEntry {
+    uint32_t scan_num;
+    uint32_t ms_level;
+    uint32_t precursor_charge;
+    uint32_t reserved;
+    double precursor_mz;
+    double base_peak_mz;
+    double base_peak_intensity;
+    double total_ion_current;
+    uint64_t file_offset;  // of the spectrum in the file the cache was written from
+};
+
+static const char kCacheMagic[8] = {'M', 'Z', 'L', 'C', 'A', 'C', 'H', 'E'};
+static const uint32_t kCacheVersion = 1;
+
+inline bool IsCacheFile(const char* filename) {
+    char magic[sizeof(kCacheMagic)];
+    std::ifstream stream(filename, std::ios::binary);
+    return stream.read(magic, sizeof(magic)) && 0 == memcmp(magic, kCacheMagic, sizeof(magic));
+}
+
+// writes the m/z values straight to the cache and the intensities to a
+// temporary file next to it, which is appended when all spectra are in, so
+// that memory does not grow with the size of the run.
+class CacheWriter {
+public:
+    explicit CacheWriter(const std::string& path)
+            : path_(path), intensity_path_(path + ".intensity"),
+              stream_(path, std::ios::binary | std::ios::trunc),
+              intensity_stream_(intensity_path_, std::ios::binary | std::ios::trunc) {
+        if (!stream_ || !intensity_stream_) { Fail(); }
+        CacheHeader header = {};
+        stream_.write(reinterpret_cast<const char*>(&header), sizeof(header));  // written again at the end
+        peak_starts_.push_back(0);
+    }
+
+    ~CacheWriter() {
+        if (!is_finished_) {
+            stream_.close();
+            intensity_stream_.close();
+            remove(path_.c_str());
+            remove(intensity_path_.c_str());
+        }
+    }
+
+    void Add(const MzLoader::Spectrum& spectrum) {
+        CacheEntry entry = {spectrum.scan_num, spectrum.ms_level, spectrum.precursor_charge, 0,
+                            spectrum.precursor_mz, spectrum.base_peak_mz, spectrum.base_peak_intensity,
+                            spectrum.total_ion_current, spectrum.file_offset};
+        entries_.push_back(entry);
+        for (auto& peak : spectrum.peaks) {
+            stream_.write(reinterpret_cast<const char*>(&peak.first), sizeof(double));
+            intensity_stream_.write(reinterpret_cast<const char*>(&peak.second), sizeof(double));
+        }
+        peak_starts_.push_back(peak_starts_.back() + spectrum.peaks.size());
+    }
+
+    void Finish() {
+        CacheHeader header;
+        memcpy(header.magic, kCacheMagic, sizeof(header.magic));
+        header.version = kCacheVersion;
+        header.reserved = 0;
+        header.spectrum_count = entries_.size();
+        header.peak_count = peak_starts_.back();
+        header.mz_offset = sizeof(CacheHeader);
+        header.intensity_offset = header.mz_offset + header.peak_count * sizeof(double);
+        header.entries_offset = header.intensity_offset + header.peak_count * sizeof(double);
+        header.peak_starts_offset = header.entries_offset + entries_.size() * sizeof(CacheEntry);
+
+        intensity_stream_.close();
+        std::ifstream intensities(intensity_path_, std::ios::binary);
+        if (header.peak_count != 0) { stream_ << intensities.rdbuf(); }
+        stream_.write(reinterpret_cast<const char*>(entries_.data()), entries_.size() * sizeof(CacheEntry));
+        stream_.write(reinterpret_cast<const char*>(peak_starts_.data()), peak_starts_.size() * sizeof(uint64_t));
+        stream_.seekp(0);
+        stream_.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream_.close();
+        intensities.close();
+        remove(intensity_path_.c_str());
+        if (!stream_) { Fail(); }
+        is_finished_ = true;
+    }
+
+private:
+    std::string path_;
+    std::string intensity_path_;
+    std::ofstream stream_;
+    std::ofstream intensity_stream_;
+    std::vector<CacheEntry> entries_;
+    std::vector<uint64_t> peak_starts_;
+    bool is_finished_ = false;
+
+    void Fail() const { throw std::runtime_error("cannot write file " + path_); }
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+
+// centroiding of profile spectra. the points of a profile rise to a local
+// maximum and fall to the next local minimum, and each such run becomes one
+// peak: its m/z is the apex of the parabola through the maximum and its two
+// neighbours, its intensity the sum of the run. runs of zero intensity give
+// no peak.
+
+// the m/z of the apex of the parabola through three points, the middle one
+// the highest. x1 if the points are on a line.
+inline double InterpolateApex(double x0, double y0, double x1, double y1, double x2, double y2) {
+    auto left = (x1 - x0) * (y1 - y2);
+    auto right = (x1 - x2) * (y1 - y0);
+    auto denominator = left - right;
+    if (denominator == 0) { return x1; }
+    auto apex = x1 - 0.5 * ((x1 - x0) * left - (x1 - x2) * right) / denominator;
+    return apex < x0 ? x0 : (apex > x2 ? x2 : apex);
+}
+
+// centroid the count profile points at mz[i * stride] and intensity[i * stride]
+// in place. the peaks are written to the front, in m/z order, and their
+// number is returned.
+inline size_t CentroidPeaks(double* mz, double* intensity, size_t count, size_t stride) {
+    size_t kept = 0;
+    size_t start = 0;
+    while (start < count) {
+        auto top = start;
+        while (top + 1 < count && intensity[(top + 1) * stride] >= intensity[top * stride]) { ++top; }
+        auto end = top;
+        while (end + 1 < count && intensity[(end + 1) * stride] < intensity[end * stride]) { ++end; }
+        double sum = 0;
+        for (auto i = start; i <= end; ++i) { sum += intensity[i * stride]; }
+        if (sum > 0) {
+            auto apex = mz[top * stride];
+            if (top > start && top < end) {
+                apex = InterpolateApex(mz[(top - 1) * stride], intensity[(top - 1) * stride], apex,
+                                       intensity[top * stride], mz[(top + 1) * stride], intensity[(top + 1) * stride]);
+            }
+            // the run is read completely, and kept is at most start
+            mz[kept * stride] = apex;
+            intensity[kept * stride] = sum;
+            ++kept;
+        }
+        start = end + 1;
+    }
+    return kept;
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstring>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MZLOADER_CONVERT_SIMD
+#ifndef MZLOADER_TARGET
+#define MZLOADER_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+// conversion of decoded binary arrays to doubles. little-endian 64-bit data,
+// the common case in mzML, is copied as is. the avx2 kernel swaps big-endian
+// data with byte shuffles and widens floats four at a time; the scalar code
+// is written so that the compiler can vectorize it for the baseline isa.
+
+enum class ConvertKernel { kScalar, kAvx2 };
+
+inline void ConvertValuesScalar(const char* data, size_t count, int precision, bool little_endian, double* out) {
+    if (precision == 64) {
+        memcpy(out, data, count * sizeof(double));
+        if (!little_endian) {
+            for (size_t i = 0; i < count; ++i) {
+                uint64_t bits;
+                memcpy(&bits, out + i, sizeof(bits));
+#ifdef _MSC_VER
+                bits = _byteswap_uint64(bits);
+#else
+                bits = __builtin_bswap64(bits);
+#endif
+                memcpy(out + i, &bits, sizeof(bits));
+            }
+        }
+    }
+    else {  // 32 bit
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t bits;
+            memcpy(&bits, data + i * sizeof(float), sizeof(bits));
+            if (!little_endian) {
+#ifdef _MSC_VER
+                bits = _byteswap_ulong(bits);
+#else
+                bits = __builtin_bswap32(bits);
+#endif
+            }
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            out[i] = value;
+        }
+    }
+}
+
+#ifdef MZLOADER_CONVERT_SIMD
+MZLOADER_TARGET("avx2")
+inline void ConvertValuesAvx2(const char* data, size_t count, int precision, bool little_endian, double* out) {
+    size_t i = 0;
+    if (precision == 64) {
+        if (little_endian) {
+            memcpy(out, data, count * sizeof(double));
+            return;
+        }
+        const __m256i swap64 = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                                7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+        for (; i + 4 <= count; i += 4) {
+            auto bits = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i * 8));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_shuffle_epi8(bits, swap64));
+        }
+    }
+    else if (little_endian) {
+        for (; i + 4 <= count; i += 4) {
+            _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_loadu_ps(reinterpret_cast<const float*>(data + i * 4))));
+        }
+    }
+    else {
+        const __m128i swap32 = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+        for (; i + 4 <= count; i += 4) {
+            auto bits = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * 4)), swap32);
+            _mm256_storeu_pd(out + i, _mm256_cvtps_pd(_mm_castsi128_ps(bits)));
+        }
+    }
+    ConvertValuesScalar(data + i * (precision / 8), count - i, precision, little_endian, out + i);
+}
+#endif
+
+inline bool IsConvertKernelSupported(ConvertKernel kernel) {
+    switch (kernel) {
+    case ConvertKernel::kScalar:
+        return true;
+#ifdef MZLOADER_CONVERT_SIMD
+    case ConvertKernel::kAvx2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+// convert count values of the given precision (32 or 64 bits) from data,
+// which needs no alignment, into out.
+inline void ConvertValues(const char* data, size_t count, int precision, bool little_endian, double* out,
+                          ConvertKernel kernel) {
+#ifdef MZLOADER_CONVERT_SIMD
+    if (kernel == ConvertKernel::kAvx2) {
+        ConvertValuesAvx2(data, count, precision, little_endian, out);
+        return;
+    }
+#endif
+    (void)kernel;
+    ConvertValuesScalar(data, count, precision, little_endian, out);
+}
+
+inline void ConvertValues(const char* data, size_t count, int precision, bool little_endian, double* out) {
+    static const auto kernel = IsConvertKernelSupported(ConvertKernel::kAvx2) ? ConvertKernel::kAvx2
+                                                                               : ConvertKernel::kScalar;
+    ConvertValues(data, count, precision, little_endian, out, kernel);
+}
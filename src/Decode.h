@@ -2,78 +2,92 @@
 
 #include "Base64.h"
 #include "Decompress.h"
+#include "Convert.h"
+#include "Numpress.h"
+#include "Scratch.h"
 #include <vector>
+#include <algorithm>
 #include <cassert>
 
-inline std::vector<double> DecodeMzData(const char* encoded_data, size_t size, int precision, bool is_zlib, bool little_endian) {
-    typedef char byte;
+// buffers for the intermediate steps of decoding, one set per thread.
+struct DecodeScratch {
+    ScratchBuffer<char> base64;
+    ScratchBuffer<char> inflated;
+    ScratchBuffer<double> mz_values;  // of the spectrum being decoded, before they are paired up
+    ScratchBuffer<double> intensity_values;
+    ScratchBuffer<double> selection;  // for picking the most intense peaks
+
+    static DecodeScratch& ForThisThread() {
+        thread_local DecodeScratch scratch;
+        return scratch;
+    }
+};
+
+// base64 decode, then inflate if is_zlib, into the scratch buffers of the
+// thread. expected_size is the size of the inflated data if known, 0
+// otherwise.
+inline const char* DecodeBinary(const char* encoded_data, size_t size, bool is_zlib, size_t expected_size,
+                                size_t* decoded_size) {
+    auto& scratch = DecodeScratch::ForThisThread();
 
     // base64 decode
-    auto buffer_size = size / 4 * 3;  // enough for decoding base64
-    byte* buffer = new byte[buffer_size + 1]();  // doing initialization at the same time
-    auto decoded_size = decode(encoded_data, size, buffer);
+    auto buffer = scratch.base64.Reserve((size + 3) / 4 * 3);  // enough for decoding base64, even without padding
+    *decoded_size = decode(encoded_data, static_cast<int>(size), buffer);
 
     // zlib decompress
-    unsigned long dest_len;
-    byte* dest = nullptr;
     if (is_zlib) {
-        dest = decompress(buffer, decoded_size, &dest_len);
-        delete[] buffer;
-    }
-    else {
-        dest = buffer;
-        dest_len = decoded_size;
+        *decoded_size = decompress(buffer, *decoded_size, expected_size, scratch.inflated);
+        buffer = scratch.inflated.data();
     }
+    return buffer;
+}
+
+// decode one binary array into values and return the number of values.
+// array_length is the number of values the data holds as stated in the file,
+// 0 when unknown. it only sizes the decompression buffer. all memory is
+// reused from earlier arrays when it is large enough.
+inline size_t DecodeMzData(const char* encoded_data, size_t size, int precision, bool is_zlib, bool little_endian,
+                           size_t array_length, ScratchBuffer<double>& values) {
+    size_t decoded_size;
+    auto buffer = DecodeBinary(encoded_data, size, is_zlib, array_length * (precision / 8), &decoded_size);
 
     // retrieve values
     assert(precision == 64 || precision == 32);  // only these two precisions are allowed.
     auto step_size = precision / 8;  // step size in byte unit
-    auto vector_size = dest_len / step_size;
-    std::vector<double> decoded_data(vector_size);  // pre-allocate space
-    if (little_endian) {
-        if (precision == 64) {
-            for (unsigned i = 0; i < vector_size; ++i) {
-                double dbuf;
-                byte* ptr = reinterpret_cast<byte*>(&dbuf);
-                for (auto j = 0; j < step_size; ++j) {
-                    *(ptr + j) = dest[i * step_size + j];
-                }
-                decoded_data[i] = dbuf;
-            }
-        }
-        else {  // 32 bit
-            for (unsigned i = 0; i < vector_size; ++i) {
-                float fbuf;
-                byte* ptr = reinterpret_cast<byte*>(&fbuf);
-                for (auto j = 0; j < step_size; ++j) {
-                    *(ptr + j) = dest[i * step_size + j];
-                }
-                decoded_data[i] = fbuf;
-            }
-        }
-    }
-    else {  // big endian
-        if (precision == 64) {
-            for (unsigned i = 0; i < vector_size; ++i) {
-                double dbuf;
-                byte* ptr = reinterpret_cast<byte*>(&dbuf);
-                for (auto j = 0; j < step_size; ++j) {
-                    *(ptr + j) = dest[i * step_size + step_size - 1 - j];
-                }
-                decoded_data[i] = dbuf;
-            }
-        }
-        else {  // 32 bit
-            for (unsigned i = 0; i < vector_size; ++i) {
-                float fbuf;
-                byte* ptr = reinterpret_cast<byte*>(&fbuf);
-                for (auto j = 0; j < step_size; ++j) {
-                    *(ptr + j) = dest[i * step_size + step_size - 1 - j];
-                }
-                decoded_data[i] = fbuf;
-            }
-        }
-    }
-    delete[] dest;
-    return decoded_data;
+    auto vector_size = decoded_size / step_size;
+    ConvertValues(buffer, vector_size, precision, little_endian, values.Reserve(vector_size));
+    return vector_size;
+}
+
+// the same, but only the count values from first on are converted, into the
+// start of values, for arrays of which only a part is kept. the size of the
+// whole array is returned.
+inline size_t DecodeMzData(const char* encoded_data, size_t size, int precision, bool is_zlib, bool little_endian,
+                           size_t array_length, ScratchBuffer<double>& values, size_t first, size_t count) {
+    size_t decoded_size;
+    auto buffer = DecodeBinary(encoded_data, size, is_zlib, array_length * (precision / 8), &decoded_size);
+    assert(precision == 64 || precision == 32);  // only these two precisions are allowed.
+    auto step_size = precision / 8;  // step size in byte unit
+    auto vector_size = decoded_size / step_size;
+    first = std::min(first, vector_size);
+    count = std::min(count, vector_size - first);
+    ConvertValues(buffer + first * step_size, count, precision, little_endian, values.Reserve(count));
+    return vector_size;
+}
+
+// the same for arrays in one of the numpress codecs, which may be zlib
+// compressed on top.
+inline size_t DecodeNumpressData(const char* encoded_data, size_t size, NumpressCodec codec, bool is_zlib,
+                                 ScratchBuffer<double>& values) {
+    size_t decoded_size;
+    auto buffer = DecodeBinary(encoded_data, size, is_zlib, 0, &decoded_size);
+    auto max_values = NumpressMaxValues(codec, decoded_size);
+    return DecodeNumpress(codec, buffer, decoded_size, values.Reserve(max_values));
+}
+
+inline std::vector<double> DecodeMzData(const char* encoded_data, size_t size, int precision, bool is_zlib, bool little_endian,
+                                        size_t array_length = 0) {
+    ScratchBuffer<double> values;
+    auto vector_size = DecodeMzData(encoded_data, size, precision, is_zlib, little_endian, array_length, values);
+    return std::vector<double>(values.data(), values.data() + vector_size);
 }
@@ -1,31 +1,172 @@
 #pragma once
 
+#include "Inflate.h"
+#include "Scratch.h"
 #include <zlib.h>
 #include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <memory>
+#include <cstdint>
 
-// a customized wrapper for decompression, handling unknown uncompressed data size
-inline char* decompress(const char* source, unsigned long source_len, unsigned long* dest_len) {
-    auto buffer_size = 8192;  // if not enough, double the buffer size.
-    auto buffer = new unsigned char[buffer_size]();  // dest buffer
-    *dest_len = buffer_size;
-    auto state = uncompress(buffer, dest_len, reinterpret_cast<const unsigned char*>(source), source_len);
-    while (state != Z_OK) {
+// the inflate engine behind decompress(). zlib is the reference and the
+// default; the one-shot inflater is faster when the output size is known, and
+// hands over to zlib when it is not or turns out too small. it is opted into
+// at build time with MZLOADER_ONESHOT_INFLATE, or at run time with the
+// environment variable MZLOADER_INFLATE set to "oneshot" ("zlib" goes back).
+enum class InflateBackend { kZlib, kOneShot };
+
+inline InflateBackend DefaultInflateBackend() {
+    auto name = getenv("MZLOADER_INFLATE");
+    if (name != nullptr && 0 == strcmp(name, "zlib")) { return InflateBackend::kZlib; }
+    if (name != nullptr && 0 == strcmp(name, "oneshot")) { return InflateBackend::kOneShot; }
+#ifdef MZLOADER_ONESHOT_INFLATE
+    return InflateBackend::kOneShot;
+#else
+    return InflateBackend::kZlib;
+#endif
+}
+
+// a zlib inflate stream that is set up once per thread and reset for every
+// array, instead of being allocated and initialized for each of them. the raw
+// one reads bare deflate data, to continue where the one-shot inflater stopped.
+class InflateStream {
+public:
+    explicit InflateStream(int window_bits) {
+        memset(&stream_, 0, sizeof(stream_));
+        if (inflateInit2(&stream_, window_bits) != Z_OK) {
+            throw std::runtime_error("No enough memory for decompression.");
+        }
+    }
+
+    ~InflateStream() { inflateEnd(&stream_); }
+
+    InflateStream(const InflateStream&) = delete;
+    InflateStream& operator=(const InflateStream&) = delete;
+
+    static z_stream& ForThisThread() {
+        thread_local InflateStream stream(MAX_WBITS);
+        inflateReset(&stream.stream_);
+        return stream.stream_;
+    }
+
+    static z_stream& RawForThisThread() {
+        thread_local InflateStream stream(-MAX_WBITS);
+        inflateReset(&stream.stream_);
+        return stream.stream_;
+    }
+
+private:
+    z_stream stream_;
+};
+
+// inflate the rest of the stream into dest after its first out_size bytes.
+// if the buffer turns out too small, it is doubled and inflating continues
+// where it stopped. returns the size of the whole output.
+inline size_t InflateRest(z_stream& stream, size_t out_size, ScratchBuffer<char>& dest) {
+    auto buffer = dest.data();
+    stream.next_out = reinterpret_cast<unsigned char*>(buffer + out_size);
+    stream.avail_out = static_cast<uInt>(dest.capacity() - out_size);
+    while (true) {
+        auto state = inflate(&stream, Z_FINISH);
+        if (state == Z_STREAM_END) { break; }
+        if ((state == Z_OK || state == Z_BUF_ERROR) && stream.avail_out == 0) {
+            // buffer is not enough, so double the buffer size and keep what is already inflated.
+            auto inflated = dest.capacity();
+            buffer = dest.Reserve(inflated * 2, inflated);
+            stream.next_out = reinterpret_cast<unsigned char*>(buffer + inflated);
+            stream.avail_out = static_cast<uInt>(dest.capacity() - inflated);
+            continue;
+        }
         switch (state) {
         case Z_MEM_ERROR:
             throw std::runtime_error("No enough memory for decompression.");
         case Z_DATA_ERROR:
+        case Z_NEED_DICT:
+        case Z_BUF_ERROR:  // input ended before the stream did
             throw std::runtime_error("Compressed data is broken.");
-        case Z_BUF_ERROR:
-            // buffer is not enough, so double the buffer size.
-            delete[] buffer;
-            buffer_size *= 2;
-            buffer = new unsigned char[buffer_size]();
-            *dest_len = buffer_size;
-            state = uncompress(buffer, dest_len, reinterpret_cast<const unsigned char*>(source), source_len);
-            break;
         default:
             throw std::runtime_error("Impossible path in decompressing.");
         }
     }
-    return reinterpret_cast<char*>(buffer);
+    return out_size + stream.total_out;
+}
+
+// the output is inflated once, into a buffer of expected_len bytes when the
+// caller knows the size from the array length, otherwise of an estimate.
+inline size_t InflateWithZlib(const char* source, unsigned long source_len, unsigned long expected_len,
+                              ScratchBuffer<char>& dest) {
+    dest.Reserve(expected_len != 0 ? expected_len : std::max(8192ul, source_len * 4));
+    auto& stream = InflateStream::ForThisThread();
+    stream.next_in = reinterpret_cast<unsigned char*>(const_cast<char*>(source));
+    stream.avail_in = static_cast<uInt>(source_len);
+    return InflateRest(stream, 0, dest);
+}
+
+// continue a zlib stream that the one-shot inflater could not finish, from
+// the start of the deflate block that did not fit. the out_size bytes before
+// it stay in dest and serve as the window, so only that block is inflated
+// again. the checksum covers the whole output and is verified here.
+inline size_t ResumeWithZlib(const char* source, unsigned long source_len, size_t bit_offset, size_t out_size,
+                             ScratchBuffer<char>& dest) {
+    if (bit_offset / 8 >= source_len) { throw std::runtime_error("Compressed data is broken."); }
+    auto& stream = InflateStream::RawForThisThread();
+    auto in = reinterpret_cast<const unsigned char*>(source) + bit_offset / 8;
+    auto in_end = reinterpret_cast<const unsigned char*>(source) + source_len;
+    if (bit_offset % 8 != 0) {
+        auto bits = static_cast<int>(8 - bit_offset % 8);
+        inflatePrime(&stream, bits, *in++ >> (8 - bits));
+    }
+    stream.next_in = const_cast<unsigned char*>(in);
+    stream.avail_in = static_cast<uInt>(in_end - in);
+    auto window = std::min(out_size, size_t(1) << MAX_WBITS);
+    if (window != 0) {
+        inflateSetDictionary(&stream, reinterpret_cast<const unsigned char*>(dest.data() + out_size - window),
+                             static_cast<uInt>(window));
+    }
+    auto size = InflateRest(stream, out_size, dest);
+
+    // the adler-32 trailer follows the deflate data, at the next byte
+    if (stream.avail_in < 4) { throw std::runtime_error("Compressed data is broken."); }
+    auto trailer = stream.next_in;
+    uint32_t expected = static_cast<uint32_t>(trailer[0]) << 24 | static_cast<uint32_t>(trailer[1]) << 16
+                        | static_cast<uint32_t>(trailer[2]) << 8 | trailer[3];
+    auto checksum = adler32(0, Z_NULL, 0);
+    for (size_t done = 0; done < size; done += 1u << 30) {  // uInt lengths
+        auto length = std::min(size - done, size_t(1) << 30);
+        checksum = adler32(checksum, reinterpret_cast<const unsigned char*>(dest.data() + done),
+                           static_cast<uInt>(length));
+    }
+    if (checksum != expected) { throw std::runtime_error("Compressed data is broken."); }
+    return size;
+}
+
+inline size_t InflateOneShot(const char* source, unsigned long source_len, unsigned long expected_len,
+                             ScratchBuffer<char>& dest) {
+    if (expected_len == 0) { return InflateWithZlib(source, source_len, expected_len, dest); }
+    thread_local std::unique_ptr<OneShotInflater> inflater(new OneShotInflater);  // its tables take ~100 KB
+    auto buffer = dest.Reserve(expected_len);
+    size_t out_size;
+    auto result = inflater->Inflate(reinterpret_cast<const unsigned char*>(source), source_len,
+                                    reinterpret_cast<unsigned char*>(buffer), dest.capacity(), &out_size);
+    if (result == OneShotInflater::Result::kOk) { return out_size; }
+    if (result == OneShotInflater::Result::kDataError) { throw std::runtime_error("Compressed data is broken."); }
+    // array length was wrong: zlib takes over at the block that did not fit
+    return ResumeWithZlib(source, source_len, inflater->BlockBitOffset(), inflater->BlockOutSize(), dest);
+}
+
+// a customized wrapper for decompression. expected_len is the size of the
+// output if known, 0 otherwise. the output goes to dest, and its size is
+// returned.
+inline size_t decompress(const char* source, unsigned long source_len, unsigned long expected_len,
+                         ScratchBuffer<char>& dest, InflateBackend backend) {
+    if (backend == InflateBackend::kOneShot) { return InflateOneShot(source, source_len, expected_len, dest); }
+    return InflateWithZlib(source, source_len, expected_len, dest);
+}
+
+inline size_t decompress(const char* source, unsigned long source_len, unsigned long expected_len,
+                         ScratchBuffer<char>& dest) {
+    static const auto backend = DefaultInflateBackend();
+    return decompress(source, source_len, expected_len, dest, backend);
 }
@@ -0,0 +1,397 @@
+#pragma once
+
+#include <zlib.h>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+
+// a one-shot inflater for zlib streams whose output fits a buffer given up
+// front, as binaryDataArray payloads do once their size is known. unlike zlib
+// it never has to stop and resume, so the whole decoder works out of a 64-bit
+// bit buffer refilled eight bytes at a time, decodes most symbols with a
+// single table lookup and copies matches in words.
+
+class OneShotInflater {
+public:
+    enum class Result { kOk, kDataError, kShortOutput };
+
+    // inflate the zlib stream in [in, in + in_size) into out. the checksum
+    // is verified. on success out_size is set to the number of bytes written.
+    Result Inflate(const unsigned char* in, size_t in_size, unsigned char* out, size_t out_capacity, size_t* out_size) {
+        if (in_size < 6) { return Result::kDataError; }
+        unsigned cmf = in[0], flg = in[1];
+        if ((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20) != 0) {
+            return Result::kDataError;  // not deflate, or needs a preset dictionary
+        }
+        reader_ = BitReader{in + 2, in + in_size, 0, 0, 0};
+        in_begin_ = in;
+        out_begin_ = out;
+        out_ = out;
+        out_end_ = out + out_capacity;
+
+        bool is_final = false;
+        while (!is_final) {
+            block_bit_offset_ = (reader_.in - in_begin_ + reader_.overrun) * 8 - reader_.bit_count;
+            block_out_size_ = out_ - out_begin_;
+            reader_.Refill();
+            is_final = reader_.Bits(1) != 0;
+            auto type = reader_.Bits(2);
+            Result result;
+            if (type == 0) { result = InflateStored(); }
+            else if (type == 1) {
+                if (!is_fixed_built_) { BuildFixedTables(); }
+                result = InflateCompressed(fixed_litlen_, fixed_dist_);
+            }
+            else if (type == 2) {
+                result = ReadDynamicTables();
+                if (result == Result::kOk) { result = InflateCompressed(litlen_, dist_); }
+            }
+            else { return Result::kDataError; }
+            if (result != Result::kOk) { return result; }
+        }
+
+        // the adler-32 trailer follows at the next byte boundary
+        reader_.AlignToByte();
+        auto trailer = reader_.in;
+        if (reader_.overrun != 0 || reader_.in_end - trailer < 4) { return Result::kDataError; }
+        uint32_t expected = static_cast<uint32_t>(trailer[0]) << 24 | static_cast<uint32_t>(trailer[1]) << 16
+                            | static_cast<uint32_t>(trailer[2]) << 8 | trailer[3];
+        *out_size = out_ - out_begin_;
+        if (adler32(adler32(0, Z_NULL, 0), out_begin_, static_cast<uInt>(*out_size)) != expected) {
+            return Result::kDataError;
+        }
+        return Result::kOk;
+    }
+
+    // after kShortOutput, where the block that did not fit begins: its
+    // offset into the input in bits, and the number of bytes written before it
+    size_t BlockBitOffset() const { return block_bit_offset_; }
+    size_t BlockOutSize() const { return block_out_size_; }
+
+private:
+    // table entries: bits 0-4 hold the code length, 8-12 the number of
+    // extra bits (or the size of a subtable, in bits), 13-15 the kind and
+    // 16-31 the value (literal byte, base length or distance, subtable start)
+    enum Kind : uint32_t { kLiteral = 0, kBase = 1, kEndOfBlock = 2, kSubtable = 3, kInvalid = 4 };
+    static const unsigned kLitlenBits = 10;  // primary table sizes
+    static const unsigned kDistBits = 8;
+    static const unsigned kPrecodeBits = 7;  // precode lengths are at most 7 bits
+    static const unsigned kMaxCodeBits = 15;
+    static const uint32_t kInvalidEntry = kInvalid << 13;
+
+    // kept in locals by the decoding loop, so that the compiler can hold it
+    // in registers despite the byte stores to the output
+    struct BitReader {
+        const unsigned char* in;
+        const unsigned char* in_end;
+        uint64_t bit_buffer;
+        unsigned bit_count;
+        size_t overrun;  // zero bytes fed past the end of the input
+
+        // make at least 56 bits available
+        void Refill() {
+            if (in_end - in >= 8) {
+                uint64_t word;
+                memcpy(&word, in, 8);  // little-endian hosts only, as is the rest of the library
+                bit_buffer |= word << bit_count;
+                in += (63 - bit_count) >> 3;
+                bit_count |= 56;
+                return;
+            }
+            while (bit_count <= 56) {
+                uint64_t byte = 0;
+                if (in < in_end) { byte = *in++; }
+                else { ++overrun; }
+                bit_buffer |= byte << bit_count;
+                bit_count += 8;
+            }
+        }
+
+        unsigned Bits(unsigned count) {
+            auto bits = static_cast<unsigned>(bit_buffer & ((uint64_t(1) << count) - 1));
+            bit_buffer >>= count;
+            bit_count -= count;
+            return bits;
+        }
+
+        // drop the bits up to the next byte boundary and hand the whole bytes
+        // still in the bit buffer back to the input
+        void AlignToByte() {
+            Bits(bit_count & 7);
+            size_t bytes_back = bit_count >> 3;
+            if (bytes_back <= overrun) { overrun -= bytes_back; }
+            else { in -= bytes_back - overrun; overrun = 0; }
+            bit_buffer = 0;
+            bit_count = 0;
+        }
+
+        // look up the entry for the next code, following a subtable if needed
+        uint32_t Lookup(const uint32_t* table, unsigned primary_bits) {
+            auto entry = table[bit_buffer & ((1u << primary_bits) - 1)];
+            if (EntryKind(entry) == kSubtable) {
+                Bits(primary_bits);
+                entry = table[EntryValue(entry) + (bit_buffer & ((1u << EntryExtra(entry)) - 1))];
+            }
+            Bits(EntryLength(entry));
+            return entry;
+        }
+    };
+
+    BitReader reader_;
+    const unsigned char* in_begin_;
+    size_t block_bit_offset_ = 0;
+    size_t block_out_size_ = 0;
+    unsigned char* out_begin_;
+    unsigned char* out_;
+    unsigned char* out_end_;
+
+    // subtables hold at most 2^5 entries for each long litlen code and 2^7
+    // for each long distance code
+    uint32_t litlen_[(1 << kLitlenBits) + 288 * (1 << (kMaxCodeBits - kLitlenBits))];
+    uint32_t dist_[(1 << kDistBits) + 32 * (1 << (kMaxCodeBits - kDistBits))];
+    uint32_t precode_[1 << kPrecodeBits];
+    uint32_t fixed_litlen_[sizeof(litlen_) / sizeof(uint32_t)];
+    uint32_t fixed_dist_[sizeof(dist_) / sizeof(uint32_t)];
+    bool is_fixed_built_ = false;
+
+    static uint32_t Entry(unsigned length, unsigned extra, Kind kind, unsigned value) {
+        return length | extra << 8 | kind << 13 | value << 16;
+    }
+    static unsigned EntryLength(uint32_t entry) { return entry & 0x1F; }
+    static unsigned EntryExtra(uint32_t entry) { return (entry >> 8) & 0x1F; }
+    static unsigned EntryKind(uint32_t entry) { return (entry >> 13) & 0x7; }
+    static unsigned EntryValue(uint32_t entry) { return entry >> 16; }
+
+    Result InflateStored() {
+        reader_.AlignToByte();
+        auto& in = reader_.in;
+        if (reader_.overrun != 0 || reader_.in_end - in < 4) { return Result::kDataError; }
+        unsigned length = in[0] | in[1] << 8;
+        unsigned length_complement = in[2] | in[3] << 8;
+        if (length != (~length_complement & 0xFFFF)) { return Result::kDataError; }
+        in += 4;
+        if (static_cast<size_t>(reader_.in_end - in) < length) { return Result::kDataError; }
+        if (static_cast<size_t>(out_end_ - out_) < length) { return Result::kShortOutput; }
+        memcpy(out_, in, length);
+        in += length;
+        out_ += length;
+        return Result::kOk;
+    }
+
+    // build a decoding table for the canonical code with the given lengths.
+    // make_entry makes the entry of each symbol, given its code length. codes
+    // longer than primary_bits continue in subtables behind the primary table.
+    template <typename MakeEntry>
+    static bool BuildTable(const uint8_t* lengths, unsigned num_symbols, unsigned primary_bits, uint32_t* table,
+                           MakeEntry make_entry) {
+        unsigned counts[kMaxCodeBits + 1] = {};
+        for (unsigned symbol = 0; symbol < num_symbols; ++symbol) { ++counts[lengths[symbol]]; }
+        counts[0] = 0;
+        unsigned next_code[kMaxCodeBits + 2];
+        unsigned code = 0;
+        int left = 1;  // codes left unused, over-subscribed codes are invalid
+        for (unsigned length = 1; length <= kMaxCodeBits; ++length) {
+            code = (code + counts[length - 1]) << 1;
+            next_code[length] = code;
+            left = (left << 1) - static_cast<int>(counts[length]);
+            if (left < 0) { return false; }
+        }
+
+        // reversed code of each symbol, since deflate sends codes from the
+        // most significant bit but they are read from the least significant
+        unsigned codes[320];
+        unsigned primary_size = 1u << primary_bits;
+        unsigned primary_mask = primary_size - 1;
+        unsigned char sub_bits[1 << kLitlenBits] = {};
+        for (unsigned symbol = 0; symbol < num_symbols; ++symbol) {
+            auto length = lengths[symbol];
+            if (length == 0) { continue; }
+            unsigned forward = next_code[length]++;
+            unsigned reversed = 0;
+            for (unsigned bit = 0; bit < length; ++bit) { reversed |= ((forward >> bit) & 1) << (length - 1 - bit); }
+            codes[symbol] = reversed;
+            if (length > primary_bits) {
+                auto& bits = sub_bits[reversed & primary_mask];
+                if (length - primary_bits > bits) { bits = static_cast<unsigned char>(length - primary_bits); }
+            }
+        }
+
+        for (unsigned i = 0; i < primary_size; ++i) { table[i] = kInvalidEntry; }
+        unsigned table_end = primary_size;
+        for (unsigned prefix = 0; prefix < primary_size; ++prefix) {
+            if (sub_bits[prefix] == 0) { continue; }
+            table[prefix] = Entry(primary_bits, sub_bits[prefix], kSubtable, table_end);
+            for (unsigned i = 0; i < (1u << sub_bits[prefix]); ++i) { table[table_end + i] = kInvalidEntry; }
+            table_end += 1u << sub_bits[prefix];
+        }
+        for (unsigned symbol = 0; symbol < num_symbols; ++symbol) {
+            auto length = lengths[symbol];
+            if (length == 0) { continue; }
+            auto reversed = codes[symbol];
+            if (length <= primary_bits) {
+                auto entry = make_entry(symbol, length);
+                for (auto i = reversed; i < primary_size; i += 1u << length) { table[i] = entry; }
+            }
+            else {
+                auto subtable = table[reversed & primary_mask];
+                auto start = EntryValue(subtable);
+                auto size = 1u << EntryExtra(subtable);
+                auto entry = make_entry(symbol, length - primary_bits);
+                for (auto i = reversed >> primary_bits; i < size; i += 1u << (length - primary_bits)) {
+                    table[start + i] = entry;
+                }
+            }
+        }
+        return true;
+    }
+
+    static uint32_t LitlenEntry(unsigned symbol, unsigned length) {
+        static const uint16_t kLengthBase[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                               35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+        static const uint8_t kLengthExtra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                               3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+        if (symbol < 256) { return Entry(length, 0, kLiteral, symbol); }
+        if (symbol == 256) { return Entry(length, 0, kEndOfBlock, 0); }
+        if (symbol > 285) { return Entry(length, 0, kInvalid, 0); }
+        return Entry(length, kLengthExtra[symbol - 257], kBase, kLengthBase[symbol - 257]);
+    }
+
+    static uint32_t DistEntry(unsigned symbol, unsigned length) {
+        static const uint16_t kDistBase[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                             257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193,
+                                             12289, 16385, 24577};
+        static const uint8_t kDistExtra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                             7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+        if (symbol > 29) { return Entry(length, 0, kInvalid, 0); }
+        return Entry(length, kDistExtra[symbol], kBase, kDistBase[symbol]);
+    }
+
+    void BuildFixedTables() {
+        uint8_t lengths[288 + 32];
+        for (unsigned symbol = 0; symbol < 288; ++symbol) {
+            lengths[symbol] = symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+        }
+        for (unsigned symbol = 288; symbol < 320; ++symbol) { lengths[symbol] = 5; }
+        BuildTable(lengths, 288, kLitlenBits, fixed_litlen_, LitlenEntry);
+        BuildTable(lengths + 288, 32, kDistBits, fixed_dist_, DistEntry);
+        is_fixed_built_ = true;
+    }
+
+    Result ReadDynamicTables() {
+        static const uint8_t kPrecodeOrder[] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        auto& reader = reader_;
+        reader.Refill();
+        unsigned num_litlen = reader.Bits(5) + 257;
+        unsigned num_dist = reader.Bits(5) + 1;
+        unsigned num_precode = reader.Bits(4) + 4;
+        if (num_litlen > 286 || num_dist > 30) { return Result::kDataError; }
+        uint8_t precode_lengths[19] = {};
+        for (unsigned i = 0; i < num_precode; ++i) {
+            if (reader.bit_count < 3) { reader.Refill(); }
+            precode_lengths[kPrecodeOrder[i]] = static_cast<uint8_t>(reader.Bits(3));
+        }
+        if (!BuildTable(precode_lengths, 19, kPrecodeBits, precode_,
+                        [](unsigned symbol, unsigned length) { return Entry(length, 0, kLiteral, symbol); })) {
+            return Result::kDataError;
+        }
+
+        uint8_t lengths[288 + 32] = {};
+        for (unsigned i = 0; i < num_litlen + num_dist; ) {
+            reader.Refill();
+            auto entry = reader.Lookup(precode_, kPrecodeBits);
+            if (EntryKind(entry) == kInvalid) { return Result::kDataError; }
+            auto symbol = EntryValue(entry);
+            if (symbol < 16) { lengths[i++] = static_cast<uint8_t>(symbol); continue; }
+            uint8_t value = 0;
+            unsigned repeat;
+            if (symbol == 16) {
+                if (i == 0) { return Result::kDataError; }
+                value = lengths[i - 1];
+                repeat = 3 + reader.Bits(2);
+            }
+            else if (symbol == 17) { repeat = 3 + reader.Bits(3); }
+            else { repeat = 11 + reader.Bits(7); }
+            if (i + repeat > num_litlen + num_dist) { return Result::kDataError; }
+            for (; repeat > 0; --repeat) { lengths[i++] = value; }
+        }
+        if (lengths[256] == 0) { return Result::kDataError; }  // no end of block
+        // distance lengths follow the literal/length lengths directly
+        uint8_t dist_lengths[32] = {};
+        memcpy(dist_lengths, lengths + num_litlen, num_dist);
+        if (!BuildTable(lengths, num_litlen, kLitlenBits, litlen_, LitlenEntry)
+                || !BuildTable(dist_lengths, num_dist, kDistBits, dist_, DistEntry)) {
+            return Result::kDataError;
+        }
+        return Result::kOk;
+    }
+
+    Result InflateCompressed(const uint32_t* litlen, const uint32_t* dist) {
+        auto reader = reader_;
+        auto out = out_;
+        auto out_begin = out_begin_;
+        auto out_end = out_end_;
+        auto result = Result::kOk;
+        while (true) {
+            // 56 bits cover the longest length code with its extra bits
+            // (15 + 5) and the longest distance code with its (15 + 13)
+            reader.Refill();
+            auto entry = reader.Lookup(litlen, kLitlenBits);
+            auto kind = EntryKind(entry);
+            if (kind == kLiteral) {
+                if (out_end - out < 3) {
+                    if (out == out_end) { result = Result::kShortOutput; break; }
+                    *out++ = static_cast<unsigned char>(EntryValue(entry));
+                    continue;
+                }
+                *out++ = static_cast<unsigned char>(EntryValue(entry));
+                // literals dominate poorly compressible data such as m/z
+                // arrays. two more codes of up to 15 bits are still in the
+                // bit buffer, so take them right away if they are literals
+                // found in the primary table.
+                entry = litlen[reader.bit_buffer & ((1u << kLitlenBits) - 1)];
+                if (EntryKind(entry) != kLiteral) { continue; }
+                reader.Bits(EntryLength(entry));
+                *out++ = static_cast<unsigned char>(EntryValue(entry));
+                entry = litlen[reader.bit_buffer & ((1u << kLitlenBits) - 1)];
+                if (EntryKind(entry) != kLiteral) { continue; }
+                reader.Bits(EntryLength(entry));
+                *out++ = static_cast<unsigned char>(EntryValue(entry));
+                continue;
+            }
+            if (kind == kEndOfBlock) { break; }
+            if (kind != kBase) { result = Result::kDataError; break; }
+            size_t length = EntryValue(entry) + reader.Bits(EntryExtra(entry));
+            entry = reader.Lookup(dist, kDistBits);
+            if (EntryKind(entry) != kBase) { result = Result::kDataError; break; }
+            size_t distance = EntryValue(entry) + reader.Bits(EntryExtra(entry));
+            if (distance > static_cast<size_t>(out - out_begin)) { result = Result::kDataError; break; }
+            if (length > static_cast<size_t>(out_end - out)) { result = Result::kShortOutput; break; }
+            out = CopyMatch(out, out_end, length, distance);
+        }
+        if (result == Result::kOk && reader.overrun * 8 > reader.bit_count) {
+            result = Result::kDataError;  // consumed bits past the end of the input
+        }
+        reader_ = reader;
+        out_ = out;
+        return result;
+    }
+
+    static unsigned char* CopyMatch(unsigned char* out, unsigned char* out_end, size_t length, size_t distance) {
+        auto source = out - distance;
+        auto end = out + length;
+        // words may run up to 7 bytes past the match, if there is room for it
+        if (distance >= 8 && static_cast<size_t>(out_end - out) >= length + 8) {
+            do {
+                uint64_t word;
+                memcpy(&word, source, 8);
+                memcpy(out, &word, 8);
+                source += 8;
+                out += 8;
+            } while (out < end);
+        }
+        else {
+            while (out < end) { *out++ = *source++; }
+        }
+        return end;
+    }
+};
@@ -2,28 +2,57 @@
 
 #include "MzLoader.h"
 #include "Decode.h"
-#include <queue>
+#include "MappedFile.h"
+#include "TagSearch.h"
+#include "SpectrumIndex.h"
+#include "Pipeline.h"
+#include "PeakOutput.h"
+#include "PeakFilter.h"
+#include "Centroid.h"
+#include "Cache.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
 
 // solve naming conflict between rapidxml and zlib by adding a macro
 #define alloc_func rapidxml_alloc_func
 #include <rapidxml.hpp>
-#include <rapidxml_utils.hpp>
 #undef alloc_func
 
 using std::vector;
 using std::pair;
 
+// neutral mass of the precursor, as the filter and PrecursorIndex use it
+inline double PrecursorMass(double precursor_mz, unsigned charge) {
+    const double kProtonMass = 1.007276;
+    return (precursor_mz - kProtonMass) * charge;
+}
+
 class Loader {
 public:
     Loader(const char* filename) : filename_(filename) {}
     virtual ~Loader() {};
     virtual std::string ToString() const = 0;
     virtual bool LoadNext(MzLoader::Spectrum& buffer) = 0;
+    virtual bool LoadScan(unsigned scan_num, MzLoader::Spectrum& buffer) = 0;
+    // the same for any layout of the peaks
+    virtual bool LoadNext(MzLoader::SpectrumHeader& header, PeakOutput& peaks) = 0;
+    virtual bool LoadScan(unsigned scan_num, MzLoader::SpectrumHeader& header, PeakOutput& peaks) = 0;
+    // the next spectrum of a header-only pass into an output that only
+    // counts peaks. such passes keep a position of their own and never run
+    // on worker threads, so they see the stated counts wherever LoadNext is.
+    virtual bool LoadNextHeader(MzLoader::SpectrumHeader& header, PeakOutput& peaks) = 0;
 
 protected:
     const char* filename_;
 
+    // the input is mapped read-only, so rapidxml must not write into it.
+    static const int kParseFlags = rapidxml::parse_non_destructive;
+
     // helper functions
     static bool NodeNameIs(rapidxml::xml_node<>* node, const char* reference) {
         return (0 == strncmp(node->name(), reference, node->name_size()));
@@ -33,68 +62,376 @@ protected:
         return (0 == strncmp(attr->value(), reference, attr->value_size()));
     }
 
+    // unlike AttrValueIs, false for a value that is only a prefix of reference
+    static bool AttrValueEquals(rapidxml::xml_attribute<>* attr, const char* reference) {
+        return attr->value_size() == strlen(reference) && AttrValueIs(attr, reference);
+    }
+
     static std::string GetAttrValue(rapidxml::xml_attribute<>* attr) {
         return std::string(attr->value(), attr->value_size());
     }
+
+    // values point into the input and are not zero-terminated, so numbers are
+    // copied to the stack for conversion instead of into a std::string. like
+    // stoi and stod, these throw std::invalid_argument if there is no number.
+    static double ToDouble(const char* text, size_t size) {
+        char number[64];
+        char* number_end;
+        auto value = strtod(TerminatedCopy(text, size, number, sizeof(number)), &number_end);
+        if (number_end == number) { throw std::invalid_argument("ToDouble"); }
+        return value;
+    }
+
+    static long ToLong(const char* text, size_t size) {
+        char number[64];
+        char* number_end;
+        auto value = strtol(TerminatedCopy(text, size, number, sizeof(number)), &number_end, 10);
+        if (number_end == number) { throw std::invalid_argument("ToLong"); }
+        return value;
+    }
+
+    static double AttrToDouble(rapidxml::xml_attribute<>* attr) { return ToDouble(attr->value(), attr->value_size()); }
+    static long AttrToLong(rapidxml::xml_attribute<>* attr) { return ToLong(attr->value(), attr->value_size()); }
+
+    static const char* TerminatedCopy(const char* text, size_t size, char* copy, size_t copy_size) {
+        size = std::min(size, copy_size - 1);
+        memcpy(copy, text, size);
+        copy[size] = '\0';
+        return copy;
+    }
+
+    // the checks of the filter that need more than the ms level
+    static bool IsAccepted(const MzLoader::Filter& filter, unsigned scan_num, unsigned charge, double precursor_mz) {
+        auto precursor_mass = PrecursorMass(precursor_mz, charge);
+        return filter.min_charge <= charge && charge <= filter.max_charge
+               && filter.min_precursor_mass <= precursor_mass && precursor_mass <= filter.max_precursor_mass
+               && filter.min_scan_num <= scan_num && scan_num <= filter.max_scan_num;
+    }
+
+    // ms1 spectra have no precursor, and their precursor fields are zero
+    // then. spectra of higher levels need one.
+    static bool IsPrecursorComplete(MzLoader::SpectrumHeader& buffer, bool precursor_info_exist) {
+        if (precursor_info_exist) { return true; }
+        buffer.precursor_charge = 0;
+        buffer.precursor_mz = 0;
+        return buffer.ms_level == 1;
+    }
+
+    static bool IsAccepted(const MzLoader::Filter& filter, const MzLoader::SpectrumHeader& header) {
+        return IsAccepted(filter, header.scan_num, header.precursor_charge, header.precursor_mz);
+    }
+
+    // for outputs that only count peaks, the count the file states, if it
+    // does. the peak params are checked like for decoding, so that the same
+    // spectra pass, but the data is neither base64 decoded nor inflated.
+    template <typename ArePeakParamsValid>
+    static bool StoreStatedCount(PeakOutput& peaks, rapidxml::xml_attribute<>* count_attr,
+                                 ArePeakParamsValid are_peak_params_valid, bool* is_valid) {
+        if (!peaks.CountsOnly() || count_attr == nullptr) { return false; }
+        *is_valid = are_peak_params_valid();
+        if (*is_valid) { peaks.StoreCount(AttrToLong(count_attr)); }
+        return true;
+    }
+
+    static unsigned ThreadCount(unsigned requested) {
+        if (requested != 0) { return requested; }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // spot check that the first and last offsets of an index read from the
+    // file land on start tags, as they do not after e.g. line ending changes.
+    static bool IndexPointsAt(const SpectrumIndex& index, const MappedFile& file, const char* start_tag) {
+        auto tag_size = strlen(start_tag);
+        for (auto i : {size_t(0), index.size() - 1}) {
+            if (index[i].offset + tag_size > file.size()) { return false; }
+            if (0 != strncmp(file.data() + index[i].offset, start_tag, tag_size)) { return false; }
+        }
+        return true;
+    }
+};
+
+// parses a single element copied out of the input, so that neither the
+// whole document nor its node tree have to be kept in memory.
+class ElementParser {
+public:
+    rapidxml::xml_node<>* Parse(const char* begin, const char* end) {
+        window_.assign(begin, end);  // the window keeps its capacity between elements
+        window_.push_back('\0');
+        doc_.clear();
+        doc_.parse<0>(window_.data());  // the copy is ours, parse in place
+        return doc_.first_node();
+    }
+
+private:
+    vector<char> window_;
+    rapidxml::xml_document<> doc_;
 };
 
 class MzmlLoader : public Loader {
 public:
-    MzmlLoader(const char* filename) : Loader(filename), file_(filename) {
-        doc_.parse<0>(file_.data());
-        auto mzml_root = doc_.first_node("indexedmzML") != nullptr
-                         ? doc_.first_node("indexedmzML")->first_node("mzML")
-                         : doc_.first_node("mzML");
-        next_spectrum_node_ = mzml_root->first_node("run")->first_node("spectrumList")->first_node("spectrum");
+    // a concurrent loader always decodes on the worker pool, which is started
+    // right away so that LoadNext can be called from several threads.
+    MzmlLoader(const char* filename, const MzLoader::LoadOptions& options, bool is_concurrent)
+            : Loader(filename), file_(filename), streaming_(options.streaming),
+              use_index_file_(options.use_index_file), num_threads_(ThreadCount(options.num_threads)),
+              use_pipeline_(is_concurrent || num_threads_ > 1), is_ordered_(options.ordered_delivery),
+              options_(options) {
+        if (use_index_file_) { OpenIndexFile(); }
+        if (is_concurrent) { StartPipeline(); }
     }
     ~MzmlLoader() override {}
     std::string ToString() const override { return "<Loader format=mzML path=" + std::string(filename_) + '>'; }
 
     bool LoadNext(MzLoader::Spectrum& buffer) override {
-        while (next_spectrum_node_ != nullptr) {
-            auto are_params_complete = SetParams(buffer, next_spectrum_node_);
-            if (!are_params_complete) { next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue; }
-            if (buffer.ms_level != 2) { next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue; }
+        if (use_pipeline_) {
+            if (!pipeline_) { StartPipeline(); }
+            return pipeline_->Next(buffer);
+        }
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadNext(buffer, peaks);
+    }
 
-            auto precursor_info_exist = SetPrecursorInfo(buffer, next_spectrum_node_);
-            if (!precursor_info_exist) { next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue; }
-            auto precursor_molecule_weight = buffer.precursor_mz * buffer.precursor_charge - buffer.precursor_charge * 1.007;
-//            if (precursor_molecule_weight < 700 || 5000 < precursor_molecule_weight) {
-//                next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue;
-//            }
+    bool LoadNext(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        if (use_pipeline_) {
+            if (!pipeline_) { StartPipeline(); }
+            return pipeline_->Next(buffer, peaks);
+        }
+        for (auto spectrum_node = GetNextSpectrum(); spectrum_node != nullptr; spectrum_node = GetNextSpectrum()) {
+            buffer.file_offset = current_offset_;  // the header is complete before the peaks are decoded
+            if (SetSpectrum(buffer, peaks, spectrum_node, options_)) { return true; }
+        }
+        return false;
+    }
 
-            auto scan_num_exist = SetScanNum(buffer, next_spectrum_node_);
-            if (!scan_num_exist) { next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue; }
+    bool LoadScan(unsigned scan_num, MzLoader::Spectrum& buffer) override {
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadScan(scan_num, buffer, peaks);
+    }
 
-            auto mz_int_exist = SetMzIntensity(buffer, next_spectrum_node_);
-            if (!mz_int_exist) { next_spectrum_node_ = next_spectrum_node_->next_sibling(); continue; }
+    bool LoadScan(unsigned scan_num, MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        if (index_.empty()) { BuildIndex(); }
+        auto entry = index_.Find(scan_num);
+        if (entry == nullptr) { return false; }
+        auto text_end = file_.data() + file_.size();
+        auto spectrum_start = file_.data() + entry->offset;
+        auto spectrum_end = entry->length != 0 ? spectrum_start + entry->length
+                                               : FindElementEnd(spectrum_start, text_end, "spectrum");
+        if (spectrum_end == nullptr) { return false; }
+        buffer.file_offset = entry->offset;
+        return SetSpectrum(buffer, peaks, element_.Parse(spectrum_start, spectrum_end), options_);
+    }
 
-            // pass all checks, next_spectrum_node_ remains the same now.
-            break;
+    bool LoadNextHeader(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        const char* spectrum_start;
+        const char* spectrum_end;
+        while (LocateNextSpectrum(&header_cursor_, &header_next_entry_, &spectrum_start, &spectrum_end)) {
+            buffer.file_offset = spectrum_start - file_.data();
+            file_.Release(buffer.file_offset);
+            if (SetSpectrum(buffer, peaks, element_.Parse(spectrum_start, spectrum_end), options_)) { return true; }
         }
-        if (next_spectrum_node_ != nullptr) {
-            next_spectrum_node_ = next_spectrum_node_->next_sibling();
+        return false;
+    }
+
+private:
+    MappedFile file_;
+    rapidxml::xml_document<> doc_;
+    rapidxml::xml_node<>* next_spectrum_node_ = nullptr;
+    bool is_parsed_ = false;  // the document is parsed on the first LoadNext
+    // streaming mode
+    bool streaming_;
+    size_t cursor_ = 0;  // where the search for the next spectrum element starts
+    ElementParser element_;
+    // random access, built on the first LoadScan or read from the index file
+    SpectrumIndex index_;
+    bool use_index_file_;
+    size_t next_entry_ = 0;  // LoadNext position when walking the index file
+    size_t current_offset_ = 0;  // of the element GetNextSpectrum returned last
+    // LoadNextHeader position, in the text or the index file
+    size_t header_cursor_ = 0;
+    size_t header_next_entry_ = 0;
+    // parallel decoding, used by LoadNext when num_threads_ > 1
+    unsigned num_threads_;
+    bool use_pipeline_;
+    bool is_ordered_;
+    MzLoader::LoadOptions options_;
+    std::unique_ptr<DecodePipeline<ElementParser>> pipeline_;
+
+    // helper functions
+    bool IsEntryAccepted(const SpectrumIndex::Entry& entry) const {
+        return entry.ms_level == options_.filter.ms_level
+               && IsAccepted(options_.filter, entry.scan_num, entry.precursor_charge, entry.precursor_mz);
+    }
+
+    void StartPipeline() {
+        pipeline_.reset(new DecodePipeline<ElementParser>(file_,
+                [this](const char** begin, const char** end) {
+                    return LocateNextSpectrum(&cursor_, &next_entry_, begin, end);
+                },
+                [this](ElementParser& parser, const char* begin, const char* end, MzLoader::Spectrum& buffer) {
+                    PairPeakOutput peaks(buffer.peaks);
+                    return SetSpectrum(buffer, peaks, parser.Parse(begin, end), options_);
+                }, num_threads_, is_ordered_));
+    }
+
+    // find the next spectrum element without parsing the document, from the
+    // index file if there is one, otherwise by searching the text. cursor
+    // and next_entry are the position in either.
+    bool LocateNextSpectrum(size_t* cursor, size_t* next_entry, const char** spectrum_start,
+                            const char** spectrum_end) {
+        if (use_index_file_) {
+            // the index knows the header, so filtered spectra are not even parsed
+            while (*next_entry < index_.size() && !IsEntryAccepted(index_[*next_entry])) { ++*next_entry; }
+            if (*next_entry == index_.size()) { return false; }
+            auto& entry = index_[(*next_entry)++];
+            *spectrum_start = file_.data() + entry.offset;
+            *spectrum_end = *spectrum_start + entry.length;
             return true;
         }
-        else {
-            return false;
+        auto text_end = file_.data() + file_.size();
+        *spectrum_start = FindStartTag(file_.data() + *cursor, text_end, "spectrum");
+        if (*spectrum_start == nullptr) { return false; }
+        *spectrum_end = FindElementEnd(*spectrum_start, text_end, "spectrum");
+        if (*spectrum_end == nullptr) { return false; }  // truncated file
+        *cursor = *spectrum_end - file_.data();
+        return true;
+    }
+
+    rapidxml::xml_node<>* GetNextSpectrum() {
+        if (use_index_file_ || streaming_) {
+            const char* spectrum_start;
+            const char* spectrum_end;
+            if (!LocateNextSpectrum(&cursor_, &next_entry_, &spectrum_start, &spectrum_end)) { return nullptr; }
+            current_offset_ = spectrum_start - file_.data();
+            file_.Release(current_offset_);
+            return element_.Parse(spectrum_start, spectrum_end);
         }
+        if (!is_parsed_) { ParseDocument(); }
+        auto current_spectrum_node = next_spectrum_node_;
+        if (current_spectrum_node != nullptr) {
+            next_spectrum_node_ = current_spectrum_node->next_sibling();
+            current_offset_ = current_spectrum_node->name() - 1 - file_.data();  // the name follows '<'
+            file_.Release(current_offset_);
+        }
+        return current_spectrum_node;
     }
 
-private:
-    rapidxml::file<> file_;
-    rapidxml::xml_document<> doc_;
-    rapidxml::xml_node<>* next_spectrum_node_;
+    void ParseDocument() {
+        doc_.parse<kParseFlags>(file_.data());
+        auto mzml_root = doc_.first_node("indexedmzML") != nullptr
+                         ? doc_.first_node("indexedmzML")->first_node("mzML")
+                         : doc_.first_node("mzML");
+        next_spectrum_node_ = mzml_root->first_node("run")->first_node("spectrumList")->first_node("spectrum");
+        is_parsed_ = true;
+    }
+
+    // read the offsets from the <indexList> of indexedmzML. files without a
+    // usable index are indexed by searching for the spectrum start tags,
+    // which is spread over num_threads_ threads.
+    void BuildIndex() {
+        auto text_end = file_.data() + file_.size();
+        size_t index_list_offset;
+        if (FindTrailingNumber(file_.data(), file_.size(), "indexListOffset", &index_list_offset)
+                && index_list_offset < file_.size()) {
+            auto index_list_start = file_.data() + index_list_offset;
+            auto index_list_end = FindElementEnd(index_list_start, text_end, "indexList");
+            if (index_list_end != nullptr) {
+                ElementParser index_parser;
+                auto index_list_node = index_parser.Parse(index_list_start, index_list_end);
+                for (auto index_node = index_list_node->first_node("index"); index_node;
+                        index_node = index_node->next_sibling("index")) {
+                    if (!AttrValueIs(index_node->first_attribute("name"), "spectrum")) { continue; }
+                    for (auto offset_node = index_node->first_node("offset"); offset_node;
+                            offset_node = offset_node->next_sibling("offset")) {
+                        auto id = GetAttrValue(offset_node->first_attribute("idRef"));
+                        auto scan_start = id.find("scan=");
+                        if (scan_start == std::string::npos) { continue; }
+                        index_.Add(stoi(id.substr(scan_start + 5)), std::stoull(offset_node->value()));
+                    }
+                }
+            }
+        }
+        if (!index_.empty() && IndexPointsAt(index_, file_, "<spectrum")) { return; }
+        index_.Clear();  // no index, or a stale one
+        for (auto offset : FindAllStartTags(file_.data(), file_.size(), "spectrum", num_threads_)) {
+            auto spectrum_start = file_.data() + offset;
+            const char* id_begin;
+            const char* id_end;
+            if (!FindTagAttribute(spectrum_start, text_end, "id", &id_begin, &id_end)) { continue; }
+            std::string id(id_begin, id_end);
+            auto scan_start = id.find("scan=");
+            if (scan_start == std::string::npos) { continue; }
+            index_.Add(stoi(id.substr(scan_start + 5)), offset);
+        }
+    }
+
+    // reuse the index file next to the input if it is still valid, otherwise
+    // build the index from the headers of all spectra and write it.
+    void OpenIndexFile() {
+        auto index_path = std::string(filename_) + ".mzlidx";
+        auto stamp = FileStamp::Of(filename_);
+        if (index_.Load(index_path, stamp)) { return; }
+        BuildIndex();
+        SpectrumIndex header_index;
+        auto text_end = file_.data() + file_.size();
+        for (size_t i = 0; i < index_.size(); ++i) {
+            auto spectrum_start = file_.data() + index_[i].offset;
+            auto spectrum_end = FindElementEnd(spectrum_start, text_end, "spectrum");
+            if (spectrum_end == nullptr) { continue; }
+            auto spectrum_node = element_.Parse(spectrum_start, spectrum_end);
+            SpectrumIndex::Entry entry{index_[i].scan_num, 0, 0, 0, 0.0, index_[i].offset,
+                                       static_cast<uint64_t>(spectrum_end - spectrum_start)};
+            MzLoader::SpectrumHeader header;
+            if (SetParams(header, spectrum_node)) { entry.ms_level = header.ms_level; }
+            if (SetPrecursorInfo(header, spectrum_node)) {
+                entry.precursor_charge = header.precursor_charge;
+                entry.precursor_mz = header.precursor_mz;
+            }
+            header_index.Add(entry);
+            file_.Release(spectrum_end - file_.data());
+        }
+        index_ = std::move(header_index);
+        index_.Save(index_path, stamp);
+    }
+
+    // run all checks and builders, return whether the spectrum is valid
+    static bool SetSpectrum(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks, rapidxml::xml_node<>* spectrum_node,
+                            const MzLoader::LoadOptions& options) {
+        auto& filter = options.filter;
+        auto are_params_complete = SetParams(buffer, spectrum_node);
+        if (!are_params_complete) { return false; }
+        if (buffer.ms_level != filter.ms_level) { return false; }
+
+        auto precursor_info_exist = SetPrecursorInfo(buffer, spectrum_node);
+        if (!IsPrecursorComplete(buffer, precursor_info_exist)) { return false; }
+
+        auto scan_num_exist = SetScanNum(buffer, spectrum_node);
+        if (!scan_num_exist) { return false; }
+
+        if (!IsAccepted(filter, buffer)) { return false; }  // before the peaks are decoded
+        bool is_valid;
+        if (StoreStatedCount(peaks, spectrum_node->first_attribute("defaultArrayLength"),
+                             [&] { return AreArrayParamsValid(spectrum_node); }, &is_valid)) {
+            return is_valid;
+        }
+
+        auto mz_int_exist = SetMzIntensity(peaks, spectrum_node, options);
+        if (!mz_int_exist) { return false; }
+
+        return true;  // pass all checks
+    }
 
     // builders
-    static bool SetScanNum(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* spectrum_node) {
-        std::string id = spectrum_node->first_attribute("id")->value();
-        auto scan_start = id.find("scan=");
-        buffer.scan_num = stoi(id.substr(scan_start + 5));
+    static bool SetScanNum(MzLoader::SpectrumHeader& buffer, rapidxml::xml_node<>* spectrum_node) {
+        auto id_attr = spectrum_node->first_attribute("id");
+        auto id_end = id_attr->value() + id_attr->value_size();
+        const char scan_key[] = "scan=";
+        auto scan_start = std::search(id_attr->value(), id_end, scan_key, scan_key + 5);
+        if (scan_start == id_end) { throw std::invalid_argument("no scan number in id"); }
+        buffer.scan_num = ToLong(scan_start + 5, id_end - scan_start - 5);
         return true;
     }
 
-    static bool SetParams(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* spectrum_node) {
+    static bool SetParams(MzLoader::SpectrumHeader& buffer, rapidxml::xml_node<>* spectrum_node) {
         bool set_ms_level = false;
         bool set_base_peak_mz = false;
         bool set_base_peak_intensity = false;
@@ -103,28 +440,28 @@ private:
                 param_node && NodeNameIs(param_node, "cvParam");
                 param_node = param_node->next_sibling()) {
             auto name_attr = param_node->first_attribute("name");
-            auto field_value = GetAttrValue(param_node->first_attribute("value"));
+            auto value_attr = param_node->first_attribute("value");
             if (AttrValueIs(name_attr, "ms level")) {
-                buffer.ms_level = stoi(field_value);
+                buffer.ms_level = AttrToLong(value_attr);
                 set_ms_level = true;
             }
             if (AttrValueIs(name_attr, "base peak m/z")) {
-                buffer.base_peak_mz = stod(field_value);
+                buffer.base_peak_mz = AttrToDouble(value_attr);
                 set_base_peak_mz = true;
             }
             if (AttrValueIs(name_attr, "base peak intensity")) {
-                buffer.base_peak_intensity = stod(field_value);
+                buffer.base_peak_intensity = AttrToDouble(value_attr);
                 set_base_peak_intensity = true;
             }
             if (AttrValueIs(name_attr, "total ion current")) {
-                buffer.total_ion_current = stod(field_value);
+                buffer.total_ion_current = AttrToDouble(value_attr);
                 set_total_ion_current = true;
             }
         }
         return set_ms_level && set_base_peak_mz && set_base_peak_intensity && set_total_ion_current;
     }
 
-    static bool SetPrecursorInfo(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* spectrum_node) {
+    static bool SetPrecursorInfo(MzLoader::SpectrumHeader& buffer, rapidxml::xml_node<>* spectrum_node) {
         if (spectrum_node->first_node("precursorList") == nullptr) { return false; }  // MS2 spectrum should has precursor info.
         bool set_charge = false;
         bool set_mz = false;
@@ -134,86 +471,216 @@ private:
                 param_node && NodeNameIs(param_node, "cvParam");
                 param_node = param_node->next_sibling()) {
             auto name_attr = param_node->first_attribute("name");
-            auto field_value = GetAttrValue(param_node->first_attribute("value"));
+            auto value_attr = param_node->first_attribute("value");
             if (AttrValueIs(name_attr, "charge state")) {
-                buffer.precursor_charge = stoi(field_value);
+                buffer.precursor_charge = AttrToLong(value_attr);
                 set_charge = true;
             }
             if (AttrValueIs(name_attr, "selected ion m/z")) {
-                buffer.precursor_mz = stod(field_value);
+                buffer.precursor_mz = AttrToDouble(value_attr);
                 set_mz = true;
             }
         }
         return set_charge && set_mz;
     }
 
-    static bool SetMzIntensity(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* spectrum_node) {
+    static bool IsProfile(rapidxml::xml_node<>* spectrum_node) {
+        for (auto param_node = spectrum_node->first_node("cvParam");
+                param_node && NodeNameIs(param_node, "cvParam");
+                param_node = param_node->next_sibling()) {
+            if (AttrValueEquals(param_node->first_attribute("name"), "profile spectrum")) { return true; }
+        }
+        return false;
+    }
+
+    static NumpressCodec NumpressCodecOf(rapidxml::xml_attribute<>* name_attr, bool* is_zlib) {
+        const struct { const char* name; NumpressCodec codec; bool is_zlib; } terms[] = {
+            {"MS-Numpress linear prediction compression", NumpressCodec::kLinear, false},
+            {"MS-Numpress positive integer compression", NumpressCodec::kPic, false},
+            {"MS-Numpress short logged float compression", NumpressCodec::kSlof, false},
+            {"MS-Numpress linear prediction compression followed by zlib compression", NumpressCodec::kLinear, true},
+            {"MS-Numpress positive integer compression followed by zlib compression", NumpressCodec::kPic, true},
+            {"MS-Numpress short logged float compression followed by zlib compression", NumpressCodec::kSlof, true},
+        };
+        *is_zlib = false;
+        if (0 != strncmp(name_attr->value(), "MS-Numpress", std::min<size_t>(name_attr->value_size(), 11))) {
+            return NumpressCodec::kNone;
+        }
+        for (auto& term : terms) {
+            if (AttrValueEquals(name_attr, term.name)) {
+                *is_zlib = term.is_zlib;
+                return term.codec;
+            }
+        }
+        return NumpressCodec::kNone;
+    }
+
+    // how a binary data array is stored and which one it is, false if the
+    // params are missing, contradict each other or are not supported
+    static bool ReadArrayParams(rapidxml::xml_node<>* binary_data_array_node, int* precision_out,
+                                bool* is_compressed_out, NumpressCodec* numpress_out, bool* is_mz_out) {
+        bool set_precision = false;
+        int precision = 64;
+        bool set_compress = false;
+        bool is_compressed = false;
+        auto numpress = NumpressCodec::kNone;
+        // determine which array it is
+        bool is_mz = false;
+        bool is_int = false;
+        for (auto param_node = binary_data_array_node->first_node("cvParam");
+                param_node && NodeNameIs(param_node, "cvParam");
+                param_node = param_node->next_sibling()) {
+            auto name_attr = param_node->first_attribute("name");
+            if (AttrValueIs(name_attr, "64-bit float")) {
+                if (set_precision) { return false; }  // already set precision, data error
+                precision = 64;
+                set_precision = true;
+            }
+            if (AttrValueIs(name_attr, "32-bit float")) {
+                if (set_precision) { return false; }  // already set precision, data error
+                precision = 32;
+                set_precision = true;
+            }
+            if (AttrValueIs(name_attr, "no compression")) {
+                if (set_compress) { return false; }  // already set compress state, data error
+                is_compressed = false;
+                set_compress = true;
+            }
+            if (AttrValueIs(name_attr, "zlib compression")) {
+                if (set_compress) { return false; }  // already set compress state, data error
+                is_compressed = true;
+                set_compress = true;
+            }
+            // numpress, on its own or followed by zlib in one term. older
+            // files give zlib as a term of its own, next to numpress.
+            bool is_numpress_zlib;
+            auto param_numpress = NumpressCodecOf(name_attr, &is_numpress_zlib);
+            if (param_numpress != NumpressCodec::kNone) {
+                if (numpress != NumpressCodec::kNone) { return false; }  // already set codec, data error
+                numpress = param_numpress;
+                if (is_numpress_zlib) {
+                    if (set_compress) { return false; }  // already set compress state, data error
+                    is_compressed = true;
+                    set_compress = true;
+                }
+            }
+            if (AttrValueIs(name_attr, "m/z array")) {
+                if (is_mz || is_int) { return false; }  // already choose one type, data error
+                is_mz = true;
+            }
+            if (AttrValueIs(name_attr, "intensity array")) {
+                if (is_mz || is_int) { return false; }  // already choose one type, data error
+                is_int = true;
+            }
+        }
+        // check all parameters are set
+        auto mz_int_valid = (is_mz || is_int) && !(is_mz && is_int);
+        if (numpress != NumpressCodec::kNone) { set_precision = set_compress = true; }  // defined by the codec
+        if (!set_precision || !set_compress || !mz_int_valid) { return false; }  // parameters are not enough, data error.
+        if (binary_data_array_node->first_node("binary") == nullptr) { return false; }
+        *precision_out = precision;
+        *is_compressed_out = is_compressed;
+        *numpress_out = numpress;
+        *is_mz_out = is_mz;
+        return true;
+    }
+
+    // whether the spectrum has an m/z and an intensity array that can be decoded
+    static bool AreArrayParamsValid(rapidxml::xml_node<>* spectrum_node) {
+        auto list_node = spectrum_node->first_node("binaryDataArrayList");
+        if (list_node == nullptr) { return false; }
+        bool has_mz = false;
+        bool has_intensity = false;
+        for (auto binary_data_array_node = list_node->first_node("binaryDataArray");
+                binary_data_array_node && NodeNameIs(binary_data_array_node, "binaryDataArray");
+                binary_data_array_node = binary_data_array_node->next_sibling()) {
+            int precision;
+            bool is_compressed;
+            NumpressCodec numpress;
+            bool is_mz;
+            if (!ReadArrayParams(binary_data_array_node, &precision, &is_compressed, &numpress, &is_mz)) {
+                return false;
+            }
+            (is_mz ? has_mz : has_intensity) = true;
+        }
+        return has_mz && has_intensity;
+    }
+
+    static bool SetMzIntensity(PeakOutput& peaks, rapidxml::xml_node<>* spectrum_node,
+                               const MzLoader::LoadOptions& options) {
+        auto& filter = options.filter;
+        auto centroid = options.centroid && IsProfile(spectrum_node);
+        size_t default_array_length = 0;  // unknown
+        auto default_array_length_attr = spectrum_node->first_attribute("defaultArrayLength");
+        if (default_array_length_attr != nullptr) {
+            default_array_length = AttrToLong(default_array_length_attr);
+        }
         bool set_mz_list = false;
         bool set_intensity_list = false;
-        vector<double> mz_list;
-        vector<double> intensity_list;
+        size_t mz_list_size = 0;
+        size_t intensity_list_size = 0;
+        // the peaks in the m/z window of the filter, known once the m/z array is decoded
+        size_t window_first = 0;
+        size_t window_last = 0;
+        bool is_intensity_cropped = false;  // only the intensities in the window are converted
+        auto can_crop_intensities = HasMzWindow(filter) && !centroid;  // centroids need the whole profile
+        if (spectrum_node->first_node("binaryDataArrayList") == nullptr) { return false; }
         for (auto binary_data_array_node = spectrum_node->first_node("binaryDataArrayList")->first_node("binaryDataArray");
                 binary_data_array_node && NodeNameIs(binary_data_array_node, "binaryDataArray");
                 binary_data_array_node = binary_data_array_node->next_sibling()) {
-            // extract params for decoding
-            bool set_precision = false;
-            int precision = 64;
-            bool set_compress = false;
-            bool is_compressed = false;
-            // determine which array it is
-            bool is_mz = false;
-            bool is_int = false;
-            for (auto param_node = binary_data_array_node->first_node("cvParam");
-                    param_node && NodeNameIs(param_node, "cvParam");
-                    param_node = param_node->next_sibling()) {
-                auto name_attr = param_node->first_attribute("name");
-                if (AttrValueIs(name_attr, "64-bit float")) {
-                    if (set_precision) { return false; }  // already set precision, data error
-                    precision = 64;
-                    set_precision = true;
-                }
-                if (AttrValueIs(name_attr, "32-bit float")) {
-                    if (set_precision) { return false; }  // already set precision, data error
-                    precision = 32;
-                    set_precision = true;
-                }
-                if (AttrValueIs(name_attr, "no compression")) {
-                    if (set_compress) { return false; }  // already set compress state, data error
-                    is_compressed = false;
-                    set_compress = true;
-                }
-                if (AttrValueIs(name_attr, "zlib compression")) {
-                    if (set_compress) { return false; }  // already set compress state, data error
-                    is_compressed = true;
-                    set_compress = true;
-                }
-                if (AttrValueIs(name_attr, "m/z array")) {
-                    if (is_mz || is_int) { return false; }  // already choose one type, data error
-                    is_mz = true;
-                }
-                if (AttrValueIs(name_attr, "intensity array")) {
-                    if (is_mz || is_int) { return false; }  // already choose one type, data error
-                    is_int = true;
-                }
+            int precision;
+            bool is_compressed;
+            NumpressCodec numpress;
+            bool is_mz;
+            if (!ReadArrayParams(binary_data_array_node, &precision, &is_compressed, &numpress, &is_mz)) {
+                return false;
             }
-            // check all parameters are set
-            auto mz_int_valid = (is_mz || is_int) && !(is_mz && is_int);
-            if (!set_precision || !set_compress || !mz_int_valid) { return false; }  // parameters are not enough, data error.
             // decode
             auto raw_data = binary_data_array_node->first_node("binary")->value();
             auto raw_data_size = binary_data_array_node->first_node("binary")->value_size();
-            auto decoded_data = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, true);  // little endian
-            if (is_mz) { mz_list = decoded_data; set_mz_list = true; }
-            if (is_int) { intensity_list = decoded_data; set_intensity_list = true; }
+            auto array_length = default_array_length;
+            auto array_length_attr = binary_data_array_node->first_attribute("arrayLength");  // overrides the default
+            if (array_length_attr != nullptr) { array_length = AttrToLong(array_length_attr); }
+            if (numpress != NumpressCodec::kNone) {
+                auto& values = is_mz ? peaks.MzValues() : peaks.IntensityValues();
+                auto& list_size = is_mz ? mz_list_size : intensity_list_size;
+                list_size = DecodeNumpressData(raw_data, raw_data_size, numpress, is_compressed, values);
+            }
+            else if (is_mz) {
+                mz_list_size = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, true, array_length,
+                                            peaks.MzValues());  // little endian
+            }
+            else if (set_mz_list && can_crop_intensities) {  // the intensities outside the window are not converted
+                intensity_list_size = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, true, array_length,
+                                                   peaks.IntensityValues(), window_first, window_last - window_first);
+                is_intensity_cropped = true;
+            }
+            else {
+                intensity_list_size = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, true, array_length,
+                                                   peaks.IntensityValues());  // little endian
+            }
+            if (is_mz && can_crop_intensities) {
+                FindMzWindow(filter, peaks.MzValues().data(), mz_list_size, 1, &window_first, &window_last);
+            }
+            (is_mz ? set_mz_list : set_intensity_list) = true;
         }
         if (set_mz_list && set_intensity_list) {
-            if (mz_list.size() != intensity_list.size()) { return false; }  // data error, should be the same size
-            else {  // build peaks and return
-                vector< pair<double, double> > peaks(mz_list.size());
-                for (auto i = 0; i < mz_list.size(); ++i) {
-                    peaks[i] = std::make_pair(mz_list[i], intensity_list[i]);
+            if (mz_list_size != intensity_list_size) { return false; }  // data error, should be the same size
+            else {  // build peaks of those that pass the filter and return
+                auto mz = peaks.MzValues().data();
+                auto intensity = peaks.IntensityValues().data();
+                auto count = mz_list_size;
+                if (centroid) { count = CentroidPeaks(mz, intensity, count, 1); }
+                if (HasMzWindow(filter)) {
+                    if (!is_intensity_cropped) {
+                        FindMzWindow(filter, mz, count, 1, &window_first, &window_last);
+                        intensity += window_first;
+                    }
+                    mz += window_first;
+                    count = window_last - window_first;
                 }
-                buffer.peaks = peaks;
+                if (HasPeakFilter(filter)) { count = SelectPeaks(filter, mz, intensity, count, 1); }
+                peaks.Store(mz, intensity, count, 1);
                 return true;
             }
         }
@@ -225,58 +692,263 @@ private:
 
 class MzxmlLoader : public Loader {
 public:
-    MzxmlLoader(const char* filename) : Loader(filename), file_(filename) {
-        doc_.parse<0>(file_.data());
-        for (auto scan_node = doc_.first_node("mzXML")->first_node("msRun")->first_node("scan");
-                scan_node && NodeNameIs(scan_node, "scan"); scan_node = scan_node->next_sibling()) {
-            untreated_scan_nodes_.push(scan_node);
-        }
+    // a concurrent loader always decodes on the worker pool, which is started
+    // right away so that LoadNext can be called from several threads.
+    MzxmlLoader(const char* filename, const MzLoader::LoadOptions& options, bool is_concurrent)
+            : Loader(filename), file_(filename), use_index_file_(options.use_index_file),
+              num_threads_(ThreadCount(options.num_threads)), use_pipeline_(is_concurrent || num_threads_ > 1),
+              is_ordered_(options.ordered_delivery), options_(options) {
+        if (use_index_file_) { OpenIndexFile(); }
+        if (is_concurrent) { StartPipeline(); }
     }
     ~MzxmlLoader() override {}
     std::string ToString() const override { return "<Loader format=mzXML path=" + std::string(filename_) + '>'; }
 
     bool LoadNext(MzLoader::Spectrum& buffer) override {
-        auto current_scan_node = GetNextScan();
-        while (current_scan_node != nullptr) {
-            auto are_params_complete = SetParams(buffer, current_scan_node);
-            if (!are_params_complete) { current_scan_node = GetNextScan(); continue; }
-            if (buffer.ms_level != 2) { current_scan_node = GetNextScan(); continue; }
+        if (use_pipeline_) {
+            if (!pipeline_) { StartPipeline(); }
+            return pipeline_->Next(buffer);
+        }
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadNext(buffer, peaks);
+    }
+
+    bool LoadNext(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        if (use_pipeline_) {
+            if (!pipeline_) { StartPipeline(); }
+            return pipeline_->Next(buffer, peaks);
+        }
+        for (auto scan_node = GetNextScan(); scan_node != nullptr; scan_node = GetNextScan()) {
+            buffer.file_offset = current_offset_;  // the header is complete before the peaks are decoded
+            if (SetSpectrum(buffer, peaks, scan_node, options_)) {
+                // nested scans may still sit before this point; releasing their
+                // pages only costs a re-read from the file if they are touched.
+                if (!use_index_file_) { file_.Release(current_offset_); }
+                return true;
+            }
+        }
+        return false;
+    }
 
-            auto precursor_info_exist = SetPrecursorInfo(buffer, current_scan_node);
-            if (!precursor_info_exist) { current_scan_node = GetNextScan(); continue; }
-            auto precursor_molecule_weight = buffer.precursor_mz * buffer.precursor_charge - buffer.precursor_charge * 1.007;
-            // filter
+    bool LoadScan(unsigned scan_num, MzLoader::Spectrum& buffer) override {
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadScan(scan_num, buffer, peaks);
+    }
 
-            auto mz_int_exist = SetMzIntensity(buffer, current_scan_node);
-            if (!mz_int_exist) { current_scan_node = GetNextScan(); continue; }
+    bool LoadScan(unsigned scan_num, MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        if (index_.empty()) { BuildIndex(); }
+        auto entry = index_.Find(scan_num);
+        if (entry == nullptr) { return false; }
+        auto text_end = file_.data() + file_.size();
+        auto scan_start = file_.data() + entry->offset;
+        auto scan_end = entry->length != 0 ? scan_start + entry->length
+                                           : FindElementEnd(scan_start, text_end, "scan");  // includes nested scans
+        if (scan_end == nullptr) { return false; }
+        buffer.file_offset = entry->offset;
+        return SetSpectrum(buffer, peaks, element_.Parse(scan_start, scan_end), options_);
+    }
 
-            // pass all checks, current_scan_node remains the same
-            break;
+    bool LoadNextHeader(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        const char* scan_start;
+        const char* scan_end;
+        while (LocateNextScan(&header_cursor_, &header_next_entry_, &scan_start, &scan_end)) {
+            buffer.file_offset = scan_start - file_.data();
+            if (SetSpectrum(buffer, peaks, element_.Parse(scan_start, scan_end), options_)) {
+                if (!use_index_file_) { file_.Release(buffer.file_offset); }
+                return true;
+            }
         }
-        if (current_scan_node != nullptr) { return true; }
-        else { return false; }
+        return false;
     }
 
 private:
-    rapidxml::file<> file_;
+    MappedFile file_;
     rapidxml::xml_document<> doc_;
-    std::queue<rapidxml::xml_node<>*> untreated_scan_nodes_;
+    rapidxml::xml_node<>* next_scan_node_ = nullptr;
+    bool is_parsed_ = false;  // the document is parsed on the first LoadNext
+    // random access, built on the first LoadScan or read from the index file
+    ElementParser element_;
+    SpectrumIndex index_;
+    bool use_index_file_;
+    size_t next_entry_ = 0;  // LoadNext position when walking the index file
+    size_t current_offset_ = 0;  // of the element GetNextScan returned last
+    // LoadNextHeader position, in the text or the index file
+    size_t header_cursor_ = 0;
+    size_t header_next_entry_ = 0;
+    // parallel decoding, used by LoadNext when num_threads_ > 1
+    unsigned num_threads_;
+    bool use_pipeline_;
+    bool is_ordered_;
+    MzLoader::LoadOptions options_;
+    size_t cursor_ = 0;  // where the search for the next scan element starts
+    std::unique_ptr<DecodePipeline<ElementParser>> pipeline_;
 
     // helper functions
+    bool IsEntryAccepted(const SpectrumIndex::Entry& entry) const {
+        return entry.ms_level == options_.filter.ms_level
+               && IsAccepted(options_.filter, entry.scan_num, entry.precursor_charge, entry.precursor_mz);
+    }
+
+    void StartPipeline() {
+        pipeline_.reset(new DecodePipeline<ElementParser>(file_,
+                [this](const char** begin, const char** end) {
+                    return LocateNextScan(&cursor_, &next_entry_, begin, end);
+                },
+                [this](ElementParser& parser, const char* begin, const char* end, MzLoader::Spectrum& buffer) {
+                    PairPeakOutput peaks(buffer.peaks);
+                    return SetSpectrum(buffer, peaks, parser.Parse(begin, end), options_);
+                }, num_threads_, is_ordered_));
+    }
+
+    void ParseDocument() {
+        doc_.parse<kParseFlags>(file_.data());
+        next_scan_node_ = doc_.first_node("mzXML")->first_node("msRun")->first_node("scan");
+        is_parsed_ = true;
+    }
+
+    // find the next scan element without parsing the document, from the
+    // index file if there is one, otherwise by searching the text. cursor and
+    // next_entry are the position in either. scans come in file order here,
+    // nested scans right after the start of their parent.
+    bool LocateNextScan(size_t* cursor, size_t* next_entry, const char** scan_start, const char** scan_end) {
+        if (use_index_file_) {
+            while (*next_entry < index_.size() && !IsEntryAccepted(index_[*next_entry])) { ++*next_entry; }
+            if (*next_entry == index_.size()) { return false; }
+            auto& entry = index_[(*next_entry)++];
+            *scan_start = file_.data() + entry.offset;
+            *scan_end = *scan_start + entry.length;
+            return true;
+        }
+        auto text_end = file_.data() + file_.size();
+        *scan_start = FindStartTag(file_.data() + *cursor, text_end, "scan");
+        if (*scan_start == nullptr) { return false; }
+        *scan_end = FindElementEnd(*scan_start, text_end, "scan");
+        if (*scan_end == nullptr) { return false; }  // truncated file
+        *cursor = *scan_start + 1 - file_.data();  // nested scans are searched for, too
+        return true;
+    }
+
     rapidxml::xml_node<>* GetNextScan() {
-        if (untreated_scan_nodes_.empty()) { return nullptr; }
-        auto next_scan_node = untreated_scan_nodes_.front();
-        untreated_scan_nodes_.pop();
-        for (auto child_scan_node = next_scan_node->first_node("scan");
-                child_scan_node && NodeNameIs(child_scan_node, "scan");
-                child_scan_node = child_scan_node->next_sibling()) {
-            untreated_scan_nodes_.push(child_scan_node);
+        if (use_index_file_) {
+            const char* scan_start;
+            const char* scan_end;
+            if (!LocateNextScan(&cursor_, &next_entry_, &scan_start, &scan_end)) { return nullptr; }
+            current_offset_ = scan_start - file_.data();
+            return element_.Parse(scan_start, scan_end);
+        }
+        if (!is_parsed_) { ParseDocument(); }
+        auto current_scan_node = next_scan_node_;
+        if (current_scan_node != nullptr) {
+            next_scan_node_ = NextScanInDocument(current_scan_node);
+            current_offset_ = current_scan_node->name() - 1 - file_.data();  // the name follows '<'
         }
-        return next_scan_node;
+        return current_scan_node;
+    }
+
+    // the scan after scan_node in file order, as LocateNextScan finds them:
+    // its first nested scan, otherwise the next scan beside it or beside the
+    // closest scan it is nested in.
+    static rapidxml::xml_node<>* NextScanInDocument(rapidxml::xml_node<>* scan_node) {
+        auto child_scan_node = scan_node->first_node("scan");
+        if (child_scan_node != nullptr) { return child_scan_node; }
+        for (auto node = scan_node; node != nullptr && NodeNameIs(node, "scan"); node = node->parent()) {
+            auto sibling_scan_node = node->next_sibling("scan");
+            if (sibling_scan_node != nullptr) { return sibling_scan_node; }
+        }
+        return nullptr;
+    }
+
+    // read the offsets from the <index name="scan"> of mzXML. files without a
+    // usable index are indexed by searching for the scan start tags, which
+    // is spread over num_threads_ threads.
+    void BuildIndex() {
+        auto text_end = file_.data() + file_.size();
+        size_t index_offset;
+        if (FindTrailingNumber(file_.data(), file_.size(), "indexOffset", &index_offset)
+                && index_offset < file_.size()) {
+            auto index_start = file_.data() + index_offset;
+            auto index_end = FindElementEnd(index_start, text_end, "index");
+            if (index_end != nullptr) {
+                ElementParser index_parser;
+                auto index_node = index_parser.Parse(index_start, index_end);
+                if (index_node != nullptr && AttrValueIs(index_node->first_attribute("name"), "scan")) {
+                    for (auto offset_node = index_node->first_node("offset"); offset_node;
+                            offset_node = offset_node->next_sibling("offset")) {
+                        index_.Add(stoi(GetAttrValue(offset_node->first_attribute("id"))),
+                                   std::stoull(offset_node->value()));
+                    }
+                }
+            }
+        }
+        if (!index_.empty() && IndexPointsAt(index_, file_, "<scan")) { return; }
+        index_.Clear();  // no index, or a stale one
+        for (auto offset : FindAllStartTags(file_.data(), file_.size(), "scan", num_threads_)) {
+            auto scan_start = file_.data() + offset;
+            const char* num_begin;
+            const char* num_end;
+            if (!FindTagAttribute(scan_start, text_end, "num", &num_begin, &num_end)) { continue; }
+            index_.Add(stoi(std::string(num_begin, num_end)), offset);
+        }
+    }
+
+    // reuse the index file next to the input if it is still valid, otherwise
+    // build the index from the headers of all scans and write it.
+    void OpenIndexFile() {
+        auto index_path = std::string(filename_) + ".mzlidx";
+        auto stamp = FileStamp::Of(filename_);
+        if (index_.Load(index_path, stamp)) { return; }
+        BuildIndex();
+        SpectrumIndex header_index;
+        auto text_end = file_.data() + file_.size();
+        for (size_t i = 0; i < index_.size(); ++i) {
+            auto scan_start = file_.data() + index_[i].offset;
+            auto scan_end = FindElementEnd(scan_start, text_end, "scan");
+            if (scan_end == nullptr) { continue; }
+            auto scan_node = element_.Parse(scan_start, scan_end);
+            SpectrumIndex::Entry entry{index_[i].scan_num, 0, 0, 0, 0.0, index_[i].offset,
+                                       static_cast<uint64_t>(scan_end - scan_start)};
+            MzLoader::SpectrumHeader header;
+            if (SetParams(header, scan_node)) { entry.ms_level = header.ms_level; }
+            if (SetPrecursorInfo(header, scan_node)) {
+                entry.precursor_charge = header.precursor_charge;
+                entry.precursor_mz = header.precursor_mz;
+            }
+            header_index.Add(entry);
+        }
+        index_ = std::move(header_index);
+        index_.Save(index_path, stamp);
+    }
+
+    // run all checks and builders, return whether the spectrum is valid
+    static bool SetSpectrum(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks, rapidxml::xml_node<>* scan_node,
+                            const MzLoader::LoadOptions& options) {
+        auto& filter = options.filter;
+        auto are_params_complete = SetParams(buffer, scan_node);
+        if (!are_params_complete) { return false; }
+        if (buffer.ms_level != filter.ms_level) { return false; }
+
+        auto precursor_info_exist = SetPrecursorInfo(buffer, scan_node);
+        if (!IsPrecursorComplete(buffer, precursor_info_exist)) { return false; }
+
+        if (!IsAccepted(filter, buffer)) { return false; }  // before the peaks are decoded
+        bool is_valid;
+        if (StoreStatedCount(peaks, scan_node->first_attribute("peaksCount"), [&] {
+                    rapidxml::xml_node<>* peaks_node;
+                    int precision;
+                    bool is_compressed;
+                    return ReadPeaksParams(scan_node, &peaks_node, &precision, &is_compressed);
+                }, &is_valid)) {
+            return is_valid;
+        }
+
+        auto mz_int_exist = SetMzIntensity(peaks, scan_node, options);
+        if (!mz_int_exist) { return false; }
+
+        return true;  // pass all checks
     }
 
     // builders
-    static bool SetParams(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* scan_node) {
+    static bool SetParams(MzLoader::SpectrumHeader& buffer, rapidxml::xml_node<>* scan_node) {
         auto scan_num_attr = scan_node->first_attribute("num");
         auto ms_level_attr = scan_node->first_attribute("msLevel");
         auto base_peak_mz_attr = scan_node->first_attribute("basePeakMz");
@@ -286,55 +958,212 @@ private:
                 || base_peak_intensity_attr == nullptr || total_ion_current_attr == nullptr) {
             return false;
         }
-        buffer.scan_num = stoi(GetAttrValue(scan_num_attr));
-        buffer.ms_level = stoi(GetAttrValue(ms_level_attr));
-        buffer.base_peak_mz = stod(GetAttrValue(base_peak_mz_attr));
-        buffer.base_peak_intensity = stod(GetAttrValue(base_peak_intensity_attr));
-        buffer.total_ion_current = stod(GetAttrValue(total_ion_current_attr));
+        buffer.scan_num = AttrToLong(scan_num_attr);
+        buffer.ms_level = AttrToLong(ms_level_attr);
+        buffer.base_peak_mz = AttrToDouble(base_peak_mz_attr);
+        buffer.base_peak_intensity = AttrToDouble(base_peak_intensity_attr);
+        buffer.total_ion_current = AttrToDouble(total_ion_current_attr);
         return true;
     }
 
-    static bool SetPrecursorInfo(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* scan_node) {
+    static bool SetPrecursorInfo(MzLoader::SpectrumHeader& buffer, rapidxml::xml_node<>* scan_node) {
         auto precursor_mz_node = scan_node->first_node("precursorMz");
         if (precursor_mz_node == nullptr) { return false; }
         auto precursor_charge_attr = precursor_mz_node->first_attribute("precursorCharge");
         if (precursor_charge_attr == nullptr) { return false; }
-        buffer.precursor_charge = stoi(GetAttrValue(precursor_charge_attr));
-        buffer.precursor_mz = stod(std::string(precursor_mz_node->value(), precursor_mz_node->value_size()));
+        buffer.precursor_charge = AttrToLong(precursor_charge_attr);
+        buffer.precursor_mz = ToDouble(precursor_mz_node->value(), precursor_mz_node->value_size());
         return true;
     }
 
-    static bool SetMzIntensity(MzLoader::Spectrum& buffer, rapidxml::xml_node<>* scan_node) {
-        auto peaks_node = scan_node->first_node("peaks");
-        if (peaks_node == nullptr) { return false; }
-        auto precision_attr = peaks_node->first_attribute("precision");
+    // only scans marked as not centroided, as the attribute is optional
+    static bool IsProfile(rapidxml::xml_node<>* scan_node) {
+        auto centroided_attr = scan_node->first_attribute("centroided");
+        return centroided_attr != nullptr && AttrValueEquals(centroided_attr, "0");
+    }
+
+    // the <peaks> element and how its data is stored, false if that is missing or not supported
+    static bool ReadPeaksParams(rapidxml::xml_node<>* scan_node, rapidxml::xml_node<>** peaks_node, int* precision,
+                                bool* is_compressed) {
+        *peaks_node = scan_node->first_node("peaks");
+        if (*peaks_node == nullptr) { return false; }
+        auto precision_attr = (*peaks_node)->first_attribute("precision");
         if (precision_attr == nullptr) { return false; }
-        int precision = stoi(GetAttrValue(precision_attr));
-        if (precision != 64 && precision != 32) { return false; }
+        *precision = AttrToLong(precision_attr);
+        if (*precision != 64 && *precision != 32) { return false; }
 
-        auto compression_type_attr = peaks_node->first_attribute("compressionType");
+        auto compression_type_attr = (*peaks_node)->first_attribute("compressionType");
         if (compression_type_attr == nullptr) { return false; }
-        bool is_compressed;
         if (AttrValueIs(compression_type_attr, "zlib")) {
-            is_compressed = true;
+            *is_compressed = true;
         }
         else if (AttrValueIs(compression_type_attr, "none")) {
-            is_compressed = false;
+            *is_compressed = false;
         }
         else {  // data error
             return false;
         }
+        return true;
+    }
+
+    static bool SetMzIntensity(PeakOutput& peaks, rapidxml::xml_node<>* scan_node,
+                               const MzLoader::LoadOptions& options) {
+        auto& filter = options.filter;
+        auto centroid = options.centroid && IsProfile(scan_node);
+        rapidxml::xml_node<>* peaks_node;
+        int precision;
+        bool is_compressed;
+        if (!ReadPeaksParams(scan_node, &peaks_node, &precision, &is_compressed)) { return false; }
 
         auto raw_data = peaks_node->value();
         auto raw_data_size = peaks_node->value_size();
-        auto decoded_data = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, false);  // big endian
-        auto vector_size = decoded_data.size() / 2;
-        assert(vector_size * 2 == decoded_data.size());
-        vector< std::pair<double, double> > peaks(vector_size);
-        for (auto i = 0; i < vector_size; ++i) {
-            peaks[i] = std::make_pair(decoded_data[2 * i], decoded_data[2 * i + 1]);
-        }
-        buffer.peaks = peaks;
+        size_t peaks_count = 0;  // unknown
+        auto peaks_count_attr = scan_node->first_attribute("peaksCount");
+        if (peaks_count_attr != nullptr) { peaks_count = AttrToLong(peaks_count_attr); }
+        auto decoded_size = DecodeMzData(raw_data, raw_data_size, precision, is_compressed, false, peaks_count * 2,
+                                         peaks.MzValues());  // big endian, m/z-intensity pairs
+        auto vector_size = decoded_size / 2;
+        assert(vector_size * 2 == decoded_size);
+        auto decoded_data = peaks.MzValues().data();
+        if (centroid) { vector_size = CentroidPeaks(decoded_data, decoded_data + 1, vector_size, 2); }
+        if (HasPeakFilter(filter)) {  // build peaks of those that pass the filter
+            size_t window_first = 0;
+            size_t window_last = vector_size;
+            if (HasMzWindow(filter)) { FindMzWindow(filter, decoded_data, vector_size, 2, &window_first, &window_last); }
+            decoded_data += 2 * window_first;
+            vector_size = SelectPeaks(filter, decoded_data, decoded_data + 1, window_last - window_first, 2);
+        }
+        peaks.Store(decoded_data, decoded_data + 1, vector_size, 2);
+        return true;
+    }
+};
+
+// reads a cache written by MzLoader::WriteCache. the spectra are already
+// decoded, so LoadNext only checks the filter on the header table and hands
+// out the arrays of the mapped file. there is nothing to do for worker
+// threads, and LoadNext and LoadScan are safe to call from several threads
+// as they are. the cache holds the peaks as they were written, centroid has
+// no effect on it.
+class CacheLoader : public Loader {
+public:
+    CacheLoader(const char* filename, const MzLoader::LoadOptions& options)
+            : Loader(filename), file_(filename), options_(options) {
+        if (file_.size() < sizeof(CacheHeader)) { throw std::runtime_error("Cache file is broken."); }
+        memcpy(&header_, file_.data(), sizeof(header_));
+        if (0 != memcmp(header_.magic, kCacheMagic, sizeof(kCacheMagic)) || header_.version != kCacheVersion) {
+            throw std::runtime_error("Cache file is broken.");
+        }
+        // the sections are read in place, so they have to lie within the
+        // file, and the peaks of every spectrum within the peak arrays
+        if (header_.spectrum_count >= file_.size()
+                || !IsInFile(header_.mz_offset, header_.peak_count, sizeof(double))
+                || !IsInFile(header_.intensity_offset, header_.peak_count, sizeof(double))
+                || !IsInFile(header_.entries_offset, header_.spectrum_count, sizeof(CacheEntry))
+                || !IsInFile(header_.peak_starts_offset, header_.spectrum_count + 1, sizeof(uint64_t))) {
+            throw std::runtime_error("Cache file is broken.");
+        }
+        mz_ = reinterpret_cast<const double*>(file_.data() + header_.mz_offset);
+        intensity_ = reinterpret_cast<const double*>(file_.data() + header_.intensity_offset);
+        entries_ = reinterpret_cast<const CacheEntry*>(file_.data() + header_.entries_offset);
+        peak_starts_ = reinterpret_cast<const uint64_t*>(file_.data() + header_.peak_starts_offset);
+        if (peak_starts_[0] != 0 || peak_starts_[header_.spectrum_count] != header_.peak_count) {
+            throw std::runtime_error("Cache file is broken.");
+        }
+        for (size_t i = 0; i < header_.spectrum_count; ++i) {
+            if (peak_starts_[i] > peak_starts_[i + 1]) { throw std::runtime_error("Cache file is broken."); }
+        }
+    }
+    ~CacheLoader() override {}
+    std::string ToString() const override { return "<Loader format=cache path=" + std::string(filename_) + '>'; }
+
+    bool LoadNext(MzLoader::Spectrum& buffer) override {
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadNext(buffer, peaks);
+    }
+
+    bool LoadNext(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        for (auto i = next_entry_++; i < header_.spectrum_count; i = next_entry_++) {
+            if (SetSpectrum(buffer, peaks, i)) { return true; }
+        }
+        return false;
+    }
+
+    bool LoadScan(unsigned scan_num, MzLoader::Spectrum& buffer) override {
+        PairPeakOutput peaks(buffer.peaks);
+        return LoadScan(scan_num, buffer, peaks);
+    }
+
+    bool LoadNextHeader(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        while (header_next_entry_ < header_.spectrum_count) {
+            if (SetSpectrum(buffer, peaks, header_next_entry_++)) { return true; }
+        }
+        return false;
+    }
+
+    bool LoadScan(unsigned scan_num, MzLoader::SpectrumHeader& buffer, PeakOutput& peaks) override {
+        std::call_once(scan_positions_built_, [this] {
+            for (size_t i = 0; i < header_.spectrum_count; ++i) { scan_positions_.emplace(entries_[i].scan_num, i); }
+        });
+        auto position = scan_positions_.find(scan_num);
+        if (position == scan_positions_.end()) { return false; }
+        return SetSpectrum(buffer, peaks, position->second);
+    }
+
+private:
+    MappedFile file_;
+    CacheHeader header_;
+    const double* mz_;
+    const double* intensity_;
+    const CacheEntry* entries_;
+    const uint64_t* peak_starts_;
+    MzLoader::LoadOptions options_;
+    std::atomic<size_t> next_entry_{0};
+    size_t header_next_entry_ = 0;  // LoadNextHeader position
+    std::unordered_map<unsigned, size_t> scan_positions_;  // built on the first LoadScan
+    std::once_flag scan_positions_built_;
+
+    // whether count items of size bytes at offset are within the file, and
+    // aligned to be read in place
+    bool IsInFile(uint64_t offset, uint64_t count, size_t size) const {
+        return offset % sizeof(uint64_t) == 0 && offset <= file_.size() && count <= (file_.size() - offset) / size;
+    }
+
+    bool SetSpectrum(MzLoader::SpectrumHeader& buffer, PeakOutput& peaks, size_t i) const {
+        auto& filter = options_.filter;
+        auto& entry = entries_[i];
+        if (entry.ms_level != filter.ms_level
+                || !IsAccepted(filter, entry.scan_num, entry.precursor_charge, entry.precursor_mz)) {
+            return false;
+        }
+        buffer.scan_num = entry.scan_num;
+        buffer.ms_level = entry.ms_level;
+        buffer.precursor_charge = entry.precursor_charge;
+        buffer.precursor_mz = entry.precursor_mz;
+        buffer.base_peak_mz = entry.base_peak_mz;
+        buffer.base_peak_intensity = entry.base_peak_intensity;
+        buffer.total_ion_current = entry.total_ion_current;
+        buffer.file_offset = entry.file_offset;
+        auto first = peak_starts_[i];
+        auto count = static_cast<size_t>(peak_starts_[i + 1] - first);
+        if (peaks.CountsOnly()) {
+            peaks.StoreCount(count);
+            return true;
+        }
+        if (!HasPeakFilter(filter)) {
+            peaks.StoreLasting(mz_ + first, intensity_ + first, count, 1);
+            return true;
+        }
+        // the mapping is read-only, so the peaks are filtered in a copy of the window
+        size_t window_first = 0;
+        size_t window_last = count;
+        if (HasMzWindow(filter)) { FindMzWindow(filter, mz_ + first, count, 1, &window_first, &window_last); }
+        count = window_last - window_first;
+        auto mz = peaks.MzValues().Reserve(count);
+        auto intensity = peaks.IntensityValues().Reserve(count);
+        std::copy(mz_ + first + window_first, mz_ + first + window_last, mz);
+        std::copy(intensity_ + first + window_first, intensity_ + first + window_last, intensity);
+        count = SelectPeaks(filter, mz, intensity, count, 1);
+        peaks.Store(mz, intensity, count, 1);
         return true;
     }
 };
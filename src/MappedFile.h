@@ -0,0 +1,138 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <cstddef>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// a read-only memory mapping of the whole input file.
+// the mapped text is always followed by a '\0', so it can be handed to
+// rapidxml directly as long as the parse is non-destructive. pages that the
+// loader has walked past can be handed back to the kernel with Release(),
+// so the resident size stays flat even for very large runs.
+class MappedFile {
+public:
+    static const size_t kDefaultReleaseGranularity = 16 * 1024 * 1024;
+
+    // release_granularity is how much text has to be walked past before
+    // Release() hands it back, so that the syscalls are batched
+    MappedFile(const char* filename, size_t release_granularity = kDefaultReleaseGranularity)
+            : release_granularity_(release_granularity) {
+#ifdef _WIN32
+        file_ = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file_ == INVALID_HANDLE_VALUE) { throw std::runtime_error(std::string("cannot open file ") + filename); }
+        LARGE_INTEGER file_size;
+        GetFileSizeEx(file_, &file_size);
+        size_ = static_cast<size_t>(file_size.QuadPart);
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        if (size_ % info.dwPageSize != 0) {  // otherwise no room for the '\0' behind the text
+            mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping_ != nullptr) {
+                data_ = static_cast<char*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+            }
+        }
+#else
+        fd_ = open(filename, O_RDONLY);
+        if (fd_ < 0) { throw std::runtime_error(std::string("cannot open file ") + filename); }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) { close(fd_); throw std::runtime_error(std::string("cannot open file ") + filename); }
+        size_ = static_cast<size_t>(st.st_size);
+        page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        // reserve one zero page more than the file needs, then map the file
+        // over the front of it. the tail page provides the '\0' terminator.
+        mapped_size_ = (size_ / page_size_ + 1) * page_size_;
+        void* region = mmap(nullptr, mapped_size_, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region != MAP_FAILED) {
+            if (size_ == 0 || mmap(region, size_, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd_, 0) != MAP_FAILED) {
+                data_ = static_cast<char*>(region);
+                madvise(data_, mapped_size_, MADV_SEQUENTIAL);
+            }
+            else {
+                munmap(region, mapped_size_);
+            }
+        }
+#endif
+        if (data_ == nullptr) { ReadWholeFile(filename); }
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data_ != nullptr && fallback_.empty()) { UnmapViewOfFile(data_); }
+        if (mapping_ != nullptr) { CloseHandle(mapping_); }
+        CloseHandle(file_);
+#else
+        if (data_ != nullptr && fallback_.empty()) { munmap(data_, mapped_size_); }
+        close(fd_);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // zero-terminated text of the file. rapidxml wants a non-const pointer,
+    // but the mapping is read-only, so only non-destructive parsing is allowed.
+    char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+    // hint that the text before offset will not be read again. released
+    // pages are dropped from memory and re-read from the file if touched.
+    void Release(size_t offset) {
+#ifndef _WIN32
+        if (!fallback_.empty()) { return; }
+        auto release_end = offset / page_size_ * page_size_;
+        if (release_end < released_ + release_granularity_) { return; }  // batch the syscalls
+        madvise(data_ + released_, release_end - released_, MADV_DONTNEED);
+        released_ = release_end;
+#else
+        (void)offset;
+#endif
+    }
+
+    // bytes at the front of the text that have been released so far
+    size_t released() const {
+#ifndef _WIN32
+        return released_;
+#else
+        return 0;
+#endif
+    }
+
+private:
+    size_t release_granularity_;
+    char* data_ = nullptr;
+    size_t size_ = 0;
+    std::vector<char> fallback_;  // used when the file cannot be mapped
+#ifdef _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#else
+    int fd_ = -1;
+    size_t page_size_ = 4096;
+    size_t mapped_size_ = 0;
+    size_t released_ = 0;
+#endif
+
+    void ReadWholeFile(const char* filename) {
+        std::ifstream stream(filename, std::ios::binary);
+        if (!stream) { throw std::runtime_error(std::string("cannot open file ") + filename); }
+        fallback_.resize(size_ + 1);
+        stream.read(fallback_.data(), size_);
+        fallback_[size_] = '\0';
+        data_ = fallback_.data();
+    }
+};
@@ -1,9 +1,14 @@
 #include "MzLoader.h"
 #include "Loaders.h"
+#include <algorithm>
 
 class MzLoader::Impl {
 public:
-    Impl(const char* filename) {
+    Impl(const char* filename, const LoadOptions& options, bool is_concurrent) {
+        if (IsCacheFile(filename)) {  // whatever its name
+            pLoader = std::make_unique<CacheLoader>(filename, options);
+            return;
+        }
         std::string filename_str(filename);
         auto suffix_start = filename_str.find_last_of('.');
         auto suffix = filename_str.substr(suffix_start);
@@ -18,10 +23,10 @@ public:
         }
         switch (filetype_) {
         case Filetype::mzML:
-            pLoader = std::make_unique<MzmlLoader>(filename);
+            pLoader = std::make_unique<MzmlLoader>(filename, options, is_concurrent);
             break;
         case Filetype::mzXML:
-            pLoader = std::make_unique<MzxmlLoader>(filename);
+            pLoader = std::make_unique<MzxmlLoader>(filename, options, is_concurrent);
             break;
         }
     }
@@ -30,12 +35,152 @@ public:
         return pLoader->LoadNext(buffer);
     }
 
+    bool LoadScan(unsigned scan_num, Spectrum& buffer) const {
+        return pLoader->LoadScan(scan_num, buffer);
+    }
+
+    bool LoadNext(SpectrumView& view) {
+        ViewPeakOutput peaks(view, view_mz_values_, view_intensity_values_);
+        return pLoader->LoadNext(view, peaks);
+    }
+
+    bool LoadScan(unsigned scan_num, SpectrumView& view) {
+        ViewPeakOutput peaks(view, view_mz_values_, view_intensity_values_);
+        return pLoader->LoadScan(scan_num, view, peaks);
+    }
+
+    size_t LoadBatch(size_t count, SpectrumBatch& batch) const {
+        batch.headers.clear();
+        batch.mz.clear();
+        batch.intensity.clear();
+        batch.peak_starts.assign(1, 0);
+        BatchPeakOutput peaks(batch.mz, batch.intensity);
+        SpectrumHeader header{};
+        while (batch.headers.size() < count && pLoader->LoadNext(header, peaks)) {
+            batch.headers.push_back(header);
+            batch.peak_starts.push_back(batch.mz.size());
+        }
+        return batch.headers.size();
+    }
+
+    size_t ForEach(Visitor& visitor) {
+        SpectrumHeader header{};
+        SinkPeakOutput peaks(header, visitor, sink_mz_values_, sink_intensity_values_);
+        size_t visited = 0;
+        while (pLoader->LoadNext(header, peaks)) {
+            visitor.Visit(header, peaks.Count(), peaks.KeptCount());
+            ++visited;
+        }
+        peaks.Abandon();
+        return visited;
+    }
+
+    Spectrum& IterationBuffer() { return iteration_buffer_; }
+
+    bool LoadNextHeader(SpectrumSummary& summary) const {
+        PeakCountOutput peaks(summary.peak_count);
+        return pLoader->LoadNextHeader(summary, peaks);
+    }
+
+    template <typename MzValue, typename IntensityValue>
+    bool LoadNext(SpectrumArrays<MzValue, IntensityValue>& buffer) const {
+        ArrayPeakOutput<MzValue, IntensityValue> peaks(buffer.mz, buffer.intensity);
+        return pLoader->LoadNext(buffer, peaks);
+    }
+
+    template <typename MzValue, typename IntensityValue>
+    bool LoadScan(unsigned scan_num, SpectrumArrays<MzValue, IntensityValue>& buffer) const {
+        ArrayPeakOutput<MzValue, IntensityValue> peaks(buffer.mz, buffer.intensity);
+        return pLoader->LoadScan(scan_num, buffer, peaks);
+    }
+
 private:
     enum class Filetype { mzML, mzXML };
     Filetype filetype_;
     std::unique_ptr<Loader> pLoader;
+    Spectrum iteration_buffer_;
+    // borrow the sinks of ForEach, with room of their own for larger arrays
+    ScratchBuffer<double> sink_mz_values_;
+    ScratchBuffer<double> sink_intensity_values_;
+    // what the last view points at
+    ScratchBuffer<double> view_mz_values_;
+    ScratchBuffer<double> view_intensity_values_;
 };
 
-MzLoader::MzLoader(const char* filename) : pImpl(std::make_unique<Impl>(filename)) {}
+MzLoader::MzLoader(const char* filename) : pImpl(std::make_unique<Impl>(filename, LoadOptions(), false)) {}
+MzLoader::MzLoader(const char* filename, const LoadOptions& options)
+        : pImpl(std::make_unique<Impl>(filename, options, false)) {}
 MzLoader::~MzLoader() {}
+
+void MzLoader::WriteCache(const char* filename, const char* cache_filename) {
+    WriteCache(filename, cache_filename, LoadOptions());
+}
+void MzLoader::WriteCache(const char* filename, const char* cache_filename, const LoadOptions& options) {
+    MzLoader loader(filename, options);
+    CacheWriter writer(cache_filename);
+    Spectrum buffer;
+    while (loader.LoadNext(buffer)) { writer.Add(buffer); }
+    writer.Finish();
+}
 bool MzLoader::LoadNext(Spectrum& buffer) { return pImpl->LoadNext(buffer); }
+bool MzLoader::LoadScan(unsigned scan_num, Spectrum& buffer) { return pImpl->LoadScan(scan_num, buffer); }
+bool MzLoader::LoadNext(SpectrumView& view) { return pImpl->LoadNext(view); }
+bool MzLoader::LoadScan(unsigned scan_num, SpectrumView& view) { return pImpl->LoadScan(scan_num, view); }
+size_t MzLoader::LoadBatch(size_t count, SpectrumBatch& batch) { return pImpl->LoadBatch(count, batch); }
+size_t MzLoader::ForEach(Visitor& visitor) { return pImpl->ForEach(visitor); }
+MzLoader::Iterator MzLoader::begin() { return Iterator(*this, pImpl->IterationBuffer()); }
+bool MzLoader::LoadNextHeader(SpectrumSummary& summary) { return pImpl->LoadNextHeader(summary); }
+
+template <typename MzValue, typename IntensityValue>
+bool MzLoader::LoadNext(SpectrumArrays<MzValue, IntensityValue>& buffer) { return pImpl->LoadNext(buffer); }
+template <typename MzValue, typename IntensityValue>
+bool MzLoader::LoadScan(unsigned scan_num, SpectrumArrays<MzValue, IntensityValue>& buffer) {
+    return pImpl->LoadScan(scan_num, buffer);
+}
+
+ConcurrentMzLoader::ConcurrentMzLoader(const char* filename, const MzLoader::LoadOptions& options)
+        : pImpl(std::make_unique<MzLoader::Impl>(filename, options, true)) {}
+ConcurrentMzLoader::~ConcurrentMzLoader() {}
+bool ConcurrentMzLoader::LoadNext(MzLoader::Spectrum& buffer) { return pImpl->LoadNext(buffer); }
+size_t ConcurrentMzLoader::LoadBatch(size_t count, MzLoader::SpectrumBatch& batch) {
+    return pImpl->LoadBatch(count, batch);
+}
+template <typename MzValue, typename IntensityValue>
+bool ConcurrentMzLoader::LoadNext(MzLoader::SpectrumArrays<MzValue, IntensityValue>& buffer) {
+    return pImpl->LoadNext(buffer);
+}
+
+PrecursorIndex::PrecursorIndex(const char* filename) : PrecursorIndex(filename, MzLoader::LoadOptions()) {}
+PrecursorIndex::PrecursorIndex(const char* filename, const MzLoader::LoadOptions& options) {
+    MzLoader loader(filename, options);
+    MzLoader::SpectrumSummary summary;
+    while (loader.LoadNextHeader(summary)) {
+        entries_.push_back(Entry{PrecursorMass(summary.precursor_mz, summary.precursor_charge),
+                                 summary.precursor_charge, summary.scan_num, summary.file_offset});
+    }
+    std::sort(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+        return a.precursor_mass < b.precursor_mass
+               || (a.precursor_mass == b.precursor_mass && a.file_offset < b.file_offset);
+    });
+}
+
+std::pair<const PrecursorIndex::Entry*, const PrecursorIndex::Entry*> PrecursorIndex::Find(double min_mass,
+                                                                                           double max_mass) const {
+    auto first = std::lower_bound(entries_.begin(), entries_.end(), min_mass,
+                                  [](const Entry& entry, double mass) { return entry.precursor_mass < mass; });
+    auto last = std::upper_bound(first, entries_.end(), max_mass,
+                                 [](double mass, const Entry& entry) { return mass < entry.precursor_mass; });
+    auto entries = entries_.data();
+    return std::make_pair(entries + (first - entries_.begin()), entries + (last - entries_.begin()));
+}
+
+// the array layouts the library is built with
+#define MZLOADER_INSTANTIATE_ARRAYS(MzValue, IntensityValue) \
+    template bool MzLoader::LoadNext(MzLoader::SpectrumArrays<MzValue, IntensityValue>&); \
+    template bool MzLoader::LoadScan(unsigned, MzLoader::SpectrumArrays<MzValue, IntensityValue>&); \
+    template bool ConcurrentMzLoader::LoadNext(MzLoader::SpectrumArrays<MzValue, IntensityValue>&);
+MZLOADER_INSTANTIATE_ARRAYS(double, double)
+MZLOADER_INSTANTIATE_ARRAYS(double, float)
+MZLOADER_INSTANTIATE_ARRAYS(float, float)
+MZLOADER_INSTANTIATE_ARRAYS(float, double)
+#undef MZLOADER_INSTANTIATE_ARRAYS
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stdexcept>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cmath>
+
+// decoders for the ms-numpress codecs of mzML (Teleman et al., 2014):
+// linear prediction for m/z, positive integer and short logged float for
+// intensities. linear and pic store integers as variable-length runs of
+// half bytes. the decoders read them from a 64-bit window of the input, so
+// that an integer costs a load, a byte swap and a few masks instead of a
+// loop over its half bytes. only the last few bytes go half byte by half
+// byte.
+
+enum class NumpressCodec { kNone, kLinear, kPic, kSlof };
+
+// half byte cursor over numpress data. the first half byte of a byte is its
+// upper one.
+class NumpressHalfBytes {
+public:
+    NumpressHalfBytes(const unsigned char* data, size_t size) : data_(data), end_(size * 2) {}
+
+    bool AtEnd() const {
+        // a last, lone zero half byte only pads the data to whole bytes
+        return position_ == end_ || (position_ == end_ - 1 && (data_[position_ / 2] & 0x0F) == 0);
+    }
+
+    // the next integer: a count of leading zero (0-8) or one (9-15, less 8)
+    // half bytes that are left out, then the others, least significant first.
+    uint32_t NextInt() {
+        if (position_ + 18 <= end_) {  // at least 8 bytes are left for the window
+            uint64_t window;
+            memcpy(&window, data_ + position_ / 2, sizeof(window));
+            window = ByteSwap64(window) << (4 * (position_ & 1));
+            auto head = static_cast<unsigned>(window >> 60);
+            auto stored = static_cast<uint32_t>(window >> 28);  // the 8 half bytes after the head
+            return Assemble(head, ReverseHalfBytes(stored));
+        }
+        auto start = position_;
+        auto head = Next();
+        auto skipped = head <= 8 ? head : head - 8;
+        if (position_ + (8 - skipped) > end_) { throw std::runtime_error("Numpress data is broken."); }
+        uint32_t stored = 0;
+        for (unsigned i = 0; i < 8 - skipped; ++i) { stored |= static_cast<uint32_t>(Next()) << (4 * i); }
+        position_ = start;  // Assemble moves past the integer
+        return Assemble(head, stored);
+    }
+
+private:
+    const unsigned char* data_;
+    size_t position_ = 0;  // in half bytes
+    size_t end_;
+
+    unsigned Next() {
+        auto byte = data_[position_ / 2];
+        auto half_byte = (position_ & 1) == 0 ? byte >> 4 : byte & 0x0F;
+        ++position_;
+        return half_byte;
+    }
+
+    // stored holds the half bytes after the head, the first one least
+    // significant. the ones past the integer are masked off.
+    uint32_t Assemble(unsigned head, uint32_t stored) {
+        auto skipped = head <= 8 ? head : head - 8;
+        auto mask = static_cast<uint32_t>((uint64_t(1) << (4 * (8 - skipped))) - 1);
+        position_ += 1 + (8 - skipped);
+        auto value = stored & mask;
+        return head <= 8 ? value : value | ~mask;
+    }
+
+    // the first half byte in memory order becomes the least significant
+    static uint32_t ReverseHalfBytes(uint32_t x) {
+#ifdef _MSC_VER
+        x = _byteswap_ulong(x);
+#else
+        x = __builtin_bswap32(x);
+#endif
+        return ((x & 0x0F0F0F0Fu) << 4) | ((x >> 4) & 0x0F0F0F0Fu);
+    }
+
+    static uint64_t ByteSwap64(uint64_t x) {
+#ifdef _MSC_VER
+        return _byteswap_uint64(x);
+#else
+        return __builtin_bswap64(x);
+#endif
+    }
+};
+
+// the fixed point that scales the values, 8 bytes big endian at the start
+inline double NumpressFixedPoint(const unsigned char* data) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; ++i) { bytes[i] = data[7 - i]; }
+    double fixed_point;
+    memcpy(&fixed_point, bytes, sizeof(fixed_point));
+    return fixed_point;
+}
+
+// the most values size bytes of data can hold, to size the output
+inline size_t NumpressMaxValues(NumpressCodec codec, size_t size) {
+    switch (codec) {
+    case NumpressCodec::kLinear:
+        return size < 16 ? 2 : 2 + (size - 16) * 2;
+    case NumpressCodec::kPic:
+        return size * 2;
+    case NumpressCodec::kSlof:
+        return size < 8 ? 0 : (size - 8) / 2;
+    default:
+        return 0;
+    }
+}
+
+// each value is predicted from the two before it, and only the difference
+// to the prediction is stored. the first two values are stored whole.
+inline size_t DecodeNumpressLinear(const unsigned char* data, size_t size, double* out) {
+    if (size == 8) { return 0; }
+    if (size < 12 || (size > 12 && size < 16)) { throw std::runtime_error("Numpress data is broken."); }
+    auto fixed_point = NumpressFixedPoint(data);
+    int64_t before_last = 0;
+    int64_t last = static_cast<int32_t>(data[8] | data[9] << 8 | data[10] << 16 | uint32_t(data[11]) << 24);
+    out[0] = last / fixed_point;
+    if (size == 12) { return 1; }
+    before_last = last;
+    last = static_cast<int32_t>(data[12] | data[13] << 8 | data[14] << 16 | uint32_t(data[15]) << 24);
+    out[1] = last / fixed_point;
+    size_t count = 2;
+    NumpressHalfBytes half_bytes(data + 16, size - 16);
+    while (!half_bytes.AtEnd()) {
+        auto difference = static_cast<int32_t>(half_bytes.NextInt());
+        auto value = 2 * last - before_last + difference;
+        out[count++] = value / fixed_point;
+        before_last = last;
+        last = value;
+    }
+    return count;
+}
+
+// intensities rounded to unsigned integers
+inline size_t DecodeNumpressPic(const unsigned char* data, size_t size, double* out) {
+    size_t count = 0;
+    NumpressHalfBytes half_bytes(data, size);
+    while (!half_bytes.AtEnd()) { out[count++] = half_bytes.NextInt(); }
+    return count;
+}
+
+// log(value + 1), scaled by the fixed point and stored in 16 bits
+inline size_t DecodeNumpressSlof(const unsigned char* data, size_t size, double* out) {
+    if (size < 8 || (size - 8) % 2 != 0) { throw std::runtime_error("Numpress data is broken."); }
+    auto fixed_point = NumpressFixedPoint(data);
+    auto count = (size - 8) / 2;
+    for (size_t i = 0; i < count; ++i) {
+        auto stored = static_cast<uint16_t>(data[8 + 2 * i] | data[9 + 2 * i] << 8);
+        out[i] = exp(stored / fixed_point) - 1;
+    }
+    return count;
+}
+
+inline size_t DecodeNumpress(NumpressCodec codec, const char* data, size_t size, double* out) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+    switch (codec) {
+    case NumpressCodec::kLinear:
+        return DecodeNumpressLinear(bytes, size, out);
+    case NumpressCodec::kPic:
+        return DecodeNumpressPic(bytes, size, out);
+    case NumpressCodec::kSlof:
+        return DecodeNumpressSlof(bytes, size, out);
+    default:
+        throw std::runtime_error("Numpress codec is not supported.");
+    }
+}
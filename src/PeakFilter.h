@@ -0,0 +1,72 @@
+#pragma once
+
+#include "MzLoader.h"
+#include "Decode.h"
+#include <algorithm>
+#include <cstddef>
+
+// the peak checks of MzLoader::Filter, applied to the decoded arrays before
+// the peaks are stored, so that only the peaks that pass are written out.
+// the i-th peak is at mz[i * stride] and intensity[i * stride], and the m/z
+// values are in ascending order, as mzML and mzXML writers store them.
+
+inline bool HasMzWindow(const MzLoader::Filter& filter) {
+    return filter.min_mz > 0 || filter.max_mz < std::numeric_limits<double>::infinity();
+}
+
+inline bool HasPeakFilter(const MzLoader::Filter& filter) {
+    return HasMzWindow(filter) || filter.min_intensity > 0 || filter.top_n != 0;
+}
+
+// the peaks [*first, *last) within the m/z window, by binary search
+inline void FindMzWindow(const MzLoader::Filter& filter, const double* mz, size_t count, size_t stride,
+                         size_t* first, size_t* last) {
+    // the first peak for which is_before is false
+    auto partition_point = [&](double bound, bool is_inclusive) {
+        size_t low = 0, high = count;
+        while (low < high) {
+            auto middle = low + (high - low) / 2;
+            auto value = mz[middle * stride];
+            if (value < bound || (is_inclusive && value == bound)) { low = middle + 1; }
+            else { high = middle; }
+        }
+        return low;
+    };
+    *first = partition_point(filter.min_mz, false);
+    *last = std::max(*first, partition_point(filter.max_mz, true));
+}
+
+// drop the peaks below min_intensity and all but the top_n most intense of
+// the rest, ties going to the lower m/z. the peaks that are left move to the
+// front, still in m/z order, and their number is returned.
+inline size_t SelectPeaks(const MzLoader::Filter& filter, double* mz, double* intensity, size_t count, size_t stride) {
+    auto threshold = filter.min_intensity;
+    size_t at_threshold = count;  // how many peaks of exactly the threshold are kept
+    if (filter.top_n != 0 && count > filter.top_n) {
+        auto candidates = DecodeScratch::ForThisThread().selection.Reserve(count);
+        size_t candidate_count = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (intensity[i * stride] >= threshold) { candidates[candidate_count++] = intensity[i * stride]; }
+        }
+        if (candidate_count > filter.top_n) {
+            auto nth = candidates + (candidate_count - filter.top_n);
+            std::nth_element(candidates, nth, candidates + candidate_count);
+            threshold = *nth;  // the top_n-th highest intensity
+            auto above = std::count_if(nth + 1, candidates + candidate_count, [&](double value) { return value > threshold; });
+            at_threshold = filter.top_n - above;
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i) {
+        auto value = intensity[i * stride];
+        if (value < threshold) { continue; }
+        if (value == threshold) {
+            if (at_threshold == 0) { continue; }
+            --at_threshold;
+        }
+        mz[kept * stride] = mz[i * stride];
+        intensity[kept * stride] = value;
+        ++kept;
+    }
+    return kept;
+}
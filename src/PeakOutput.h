@@ -0,0 +1,216 @@
+#pragma once
+
+#include "MzLoader.h"
+#include "Decode.h"
+#include "Scratch.h"
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+
+// where the loaders put the decoded peaks of a spectrum, so that the same
+// decoding code fills any of the spectrum layouts of the public api.
+class PeakOutput {
+public:
+    virtual ~PeakOutput() {}
+    // where the arrays are decoded to before they are stored
+    virtual ScratchBuffer<double>& MzValues() { return DecodeScratch::ForThisThread().mz_values; }
+    virtual ScratchBuffer<double>& IntensityValues() { return DecodeScratch::ForThisThread().intensity_values; }
+    // count peaks, the i-th of which is at mz[i * stride] and
+    // intensity[i * stride].
+    virtual void Store(const double* mz, const double* intensity, size_t count, size_t stride) = 0;
+    // the same for peaks that stay where they are as long as the loader, so
+    // that an output may point at them instead of copying them.
+    virtual void StoreLasting(const double* mz, const double* intensity, size_t count, size_t stride) {
+        Store(mz, intensity, count, stride);
+    }
+    // true for outputs that only want the number of peaks. the loaders then
+    // pass the count the file states to StoreCount instead of decoding the
+    // peaks, and only decode them if the file leaves it out.
+    virtual bool CountsOnly() const { return false; }
+    virtual void StoreCount(size_t count) { (void)count; }
+};
+
+class PeakCountOutput : public PeakOutput {
+public:
+    explicit PeakCountOutput(size_t& count) : count_(count) {}
+
+    bool CountsOnly() const override { return true; }
+    void StoreCount(size_t count) override { count_ = count; }
+    void Store(const double*, const double*, size_t count, size_t) override { count_ = count; }
+
+private:
+    size_t& count_;
+};
+
+class PairPeakOutput : public PeakOutput {
+public:
+    explicit PairPeakOutput(std::vector< std::pair<MzLoader::Mass, MzLoader::Intensity> >& peaks) : peaks_(peaks) {}
+
+    void Store(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        peaks_.resize(count);  // in place, reusing the capacity of the vector
+        for (size_t i = 0; i < count; ++i) {
+            peaks_[i] = std::make_pair(mz[i * stride], intensity[i * stride]);
+        }
+    }
+
+private:
+    std::vector< std::pair<MzLoader::Mass, MzLoader::Intensity> >& peaks_;
+};
+
+template <typename MzValue, typename IntensityValue>
+class ArrayPeakOutput : public PeakOutput {
+public:
+    ArrayPeakOutput(std::vector<MzValue>& mz, std::vector<IntensityValue>& intensity)
+            : mz_(mz), intensity_(intensity) {}
+
+    void Store(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        mz_.resize(count);
+        intensity_.resize(count);
+        auto mz_out = mz_.data();
+        auto intensity_out = intensity_.data();
+        for (size_t i = 0; i < count; ++i) { mz_out[i] = static_cast<MzValue>(mz[i * stride]); }
+        for (size_t i = 0; i < count; ++i) { intensity_out[i] = static_cast<IntensityValue>(intensity[i * stride]); }
+    }
+
+private:
+    std::vector<MzValue>& mz_;
+    std::vector<IntensityValue>& intensity_;
+};
+
+// appends the peaks of one spectrum after another to the arrays of a batch
+class BatchPeakOutput : public PeakOutput {
+public:
+    BatchPeakOutput(std::vector<MzLoader::Mass>& mz, std::vector<MzLoader::Intensity>& intensity)
+            : mz_(mz), intensity_(intensity) {}
+
+    void Store(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        auto start = mz_.size();
+        mz_.resize(start + count);  // in place once the batch has held the largest one
+        intensity_.resize(start + count);
+        auto mz_out = mz_.data() + start;
+        auto intensity_out = intensity_.data() + start;
+        for (size_t i = 0; i < count; ++i) { mz_out[i] = mz[i * stride]; }
+        for (size_t i = 0; i < count; ++i) { intensity_out[i] = intensity[i * stride]; }
+    }
+
+private:
+    std::vector<MzLoader::Mass>& mz_;
+    std::vector<MzLoader::Intensity>& intensity_;
+};
+
+// decodes straight into the memory the visitor places each spectrum in, as
+// long as the decoded arrays fit there, and moves the kept peaks to its
+// front. peaks decoded elsewhere are copied in. the placement is asked for
+// on the first use of the buffers, when the header is complete, and holds
+// until a spectrum is stored. a placed spectrum that the loader gives up on
+// is discarded when the next one asks for a place, or by Abandon.
+class SinkPeakOutput : public PeakOutput {
+public:
+    SinkPeakOutput(const MzLoader::SpectrumHeader& header, MzLoader::Visitor& visitor,
+                   ScratchBuffer<double>& mz_values, ScratchBuffer<double>& intensity_values)
+            : header_(header), visitor_(visitor), mz_values_(mz_values), intensity_values_(intensity_values) {}
+
+    ScratchBuffer<double>& MzValues() override {
+        Place();
+        return mz_values_;
+    }
+
+    ScratchBuffer<double>& IntensityValues() override {
+        Place();
+        return intensity_values_;
+    }
+
+    void Store(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        Place();
+        kept_count_ = count;
+        count_ = std::min(count, sink_.capacity);
+        if (stride == 1) {  // may overlap with the sink, e.g. after the m/z window
+            memmove(sink_.mz, mz, count_ * sizeof(double));
+            memmove(sink_.intensity, intensity, count_ * sizeof(double));
+        }
+        else {  // in place too, as the i-th peak never comes before the i-th slot
+            for (size_t i = 0; i < count_; ++i) {
+                auto mz_value = mz[i * stride];
+                auto intensity_value = intensity[i * stride];
+                sink_.mz[i] = mz_value;
+                sink_.intensity[i] = intensity_value;
+            }
+        }
+        is_placed_ = false;
+    }
+
+    // peaks in the sink, and peaks stored, which are more if the sink was too small
+    size_t Count() const { return count_; }
+    size_t KeptCount() const { return kept_count_; }
+
+    // discard the spectrum placed last if it was never stored
+    void Abandon() {
+        if (!is_placed_) { return; }
+        visitor_.Discard(placed_header_);
+        is_placed_ = false;
+    }
+
+private:
+    const MzLoader::SpectrumHeader& header_;
+    MzLoader::Visitor& visitor_;
+    ScratchBuffer<double>& mz_values_;
+    ScratchBuffer<double>& intensity_values_;
+    MzLoader::PeakSink sink_;
+    MzLoader::SpectrumHeader placed_header_;
+    bool is_placed_ = false;
+    size_t count_ = 0;
+    size_t kept_count_ = 0;
+
+    void Place() {
+        if (is_placed_ && header_.file_offset == placed_header_.file_offset) { return; }
+        Abandon();  // the loader moved on from the spectrum placed last
+        placed_header_ = header_;
+        sink_ = visitor_.Place(header_);
+        mz_values_.Borrow(sink_.mz, sink_.capacity);
+        intensity_values_.Borrow(sink_.intensity, sink_.capacity);
+        is_placed_ = true;
+    }
+};
+
+// decodes into buffers of the loader and only points the view at them.
+// peaks decoded elsewhere, e.g. by a worker thread, are copied there first.
+class ViewPeakOutput : public PeakOutput {
+public:
+    ViewPeakOutput(MzLoader::SpectrumView& view, ScratchBuffer<double>& mz_values,
+                   ScratchBuffer<double>& intensity_values)
+            : view_(view), mz_values_(mz_values), intensity_values_(intensity_values) {}
+
+    ScratchBuffer<double>& MzValues() override { return mz_values_; }
+    ScratchBuffer<double>& IntensityValues() override { return intensity_values_; }
+
+    void Store(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        std::less<const double*> is_before;
+        if (is_before(mz, mz_values_.data()) || !is_before(mz, mz_values_.data() + mz_values_.capacity())) {
+            auto mz_out = mz_values_.Reserve(count);
+            auto intensity_out = intensity_values_.Reserve(count);
+            for (size_t i = 0; i < count; ++i) {
+                mz_out[i] = mz[i * stride];
+                intensity_out[i] = intensity[i * stride];
+            }
+            mz = mz_out;
+            intensity = intensity_out;
+            stride = 1;
+        }
+        StoreLasting(mz, intensity, count, stride);
+    }
+
+    void StoreLasting(const double* mz, const double* intensity, size_t count, size_t stride) override {
+        view_.mz = mz;
+        view_.intensity = intensity;
+        view_.size = count;
+        view_.stride = stride;
+    }
+
+private:
+    MzLoader::SpectrumView& view_;
+    ScratchBuffer<double>& mz_values_;
+    ScratchBuffer<double>& intensity_values_;
+};
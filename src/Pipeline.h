@@ -0,0 +1,222 @@
+#pragma once
+
+#include "MzLoader.h"
+#include "MappedFile.h"
+#include "PeakOutput.h"
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <utility>
+
+// decodes spectrum elements on a pool of worker threads. a producer thread
+// locates the elements, workers parse and decode them into a fixed set of
+// slots, and Next() hands the slots out, either in file order or as soon as
+// they are done. at most kSlotsPerWorker elements per worker are in flight,
+// so memory stays bounded no matter how far the workers could run ahead.
+// Next() may be called from any number of threads at once.
+template <typename ElementParser>
+class DecodePipeline {
+public:
+    // find the next element, return false at the end of the file
+    typedef std::function<bool(const char** begin, const char** end)> Locator;
+    // parse and decode one element, return whether it is a valid spectrum
+    typedef std::function<bool(ElementParser& parser, const char* begin, const char* end,
+                               MzLoader::Spectrum& buffer)> Decoder;
+
+    DecodePipeline(MappedFile& file, Locator locate, Decoder decode, unsigned num_workers, bool is_ordered)
+            : file_(file), locate_(locate), decode_(decode), is_ordered_(is_ordered),
+              slots_(num_workers * kSlotsPerWorker), ordered_slots_(slots_.size()) {
+        for (size_t i = 0; i < slots_.size(); ++i) { free_slots_.push_back(i); }
+        producer_ = std::thread(&DecodePipeline::Produce, this);
+        for (unsigned i = 0; i < num_workers; ++i) {
+            workers_.emplace_back(&DecodePipeline::Work, this);
+        }
+    }
+
+    ~DecodePipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        slot_freed_.notify_all();
+        task_added_.notify_all();
+        producer_.join();
+        for (auto& worker : workers_) { worker.join(); }
+    }
+
+    DecodePipeline(const DecodePipeline&) = delete;
+    DecodePipeline& operator=(const DecodePipeline&) = delete;
+
+    // return the next valid spectrum, false at the end. exceptions raised
+    // while decoding are rethrown here.
+    bool Next(MzLoader::Spectrum& buffer) {
+        // swap rather than move, so the caller's peaks go back to the slot
+        // and their capacity is reused for a later element
+        return Take([&](MzLoader::Spectrum& spectrum) { std::swap(buffer, spectrum); });
+    }
+
+    // the same for the other layouts, which the peaks are copied into
+    bool Next(MzLoader::SpectrumHeader& header, PeakOutput& peaks) {
+        return Take([&](MzLoader::Spectrum& spectrum) {
+            header = spectrum;
+            if (spectrum.peaks.empty()) { peaks.Store(nullptr, nullptr, 0, 2); }
+            else { peaks.Store(&spectrum.peaks[0].first, &spectrum.peaks[0].second, spectrum.peaks.size(), 2); }
+        });
+    }
+
+private:
+    static const size_t kSlotsPerWorker = 4;
+
+    struct Slot {
+        const char* begin = nullptr;
+        const char* end = nullptr;
+        MzLoader::Spectrum spectrum;
+        bool is_valid = false;
+        bool is_done = false;
+        std::exception_ptr error;
+    };
+
+    MappedFile& file_;
+    Locator locate_;
+    Decoder decode_;
+    bool is_ordered_;
+    std::vector<Slot> slots_;
+    std::vector<size_t> free_slots_;
+    std::queue<size_t> tasks_;  // slots waiting for a worker
+    std::vector<size_t> ordered_slots_;  // slot of each element in flight, by sequence number
+    std::queue<size_t> done_slots_;  // finished slots, in order of completion
+    size_t located_ = 0;  // elements handed to the workers
+    size_t delivered_ = 0;  // elements taken by Next()
+    bool is_located_all_ = false;
+    bool stopping_ = false;
+    std::mutex mutex_;
+    std::condition_variable task_added_;
+    std::condition_variable slot_done_;
+    std::condition_variable slot_freed_;
+    std::thread producer_;
+    std::vector<std::thread> workers_;
+
+    // whether Next() can take a slot, call with mutex_ held
+    bool IsNextDone() const {
+        if (is_ordered_) {
+            return delivered_ < located_ && slots_[ordered_slots_[delivered_ % ordered_slots_.size()]].is_done;
+        }
+        return !done_slots_.empty();
+    }
+
+    // hand the next valid spectrum to deliver, which runs without the lock
+    // held, as the slot is not given out again before it returns.
+    template <typename Deliver>
+    bool Take(Deliver deliver) {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            slot_done_.wait(lock, [&] { return IsNextDone() || (is_located_all_ && delivered_ == located_); });
+            if (!IsNextDone()) { return false; }
+            size_t slot_id;
+            if (is_ordered_) { slot_id = ordered_slots_[delivered_ % ordered_slots_.size()]; }
+            else { slot_id = done_slots_.front(); done_slots_.pop(); }
+            ++delivered_;
+            auto& slot = slots_[slot_id];
+            auto is_valid = slot.is_valid;
+            auto error = slot.error;
+            auto offset = slot.begin - file_.data();
+            // out of order, earlier elements may still be decoding
+            if (is_ordered_) { file_.Release(offset); }
+            if (is_valid) {
+                lock.unlock();
+                slot.spectrum.file_offset = offset;
+                deliver(slot.spectrum);
+                lock.lock();
+            }
+            slot.is_done = false;
+            free_slots_.push_back(slot_id);
+            lock.unlock();
+            slot_freed_.notify_one();
+            if (error) { std::rethrow_exception(error); }
+            if (is_valid) { return true; }
+        }
+    }
+
+    // call with mutex_ held
+    void MarkDone(size_t slot_id) {
+        slots_[slot_id].is_done = true;
+        if (!is_ordered_) { done_slots_.push(slot_id); }
+        slot_done_.notify_all();
+    }
+
+    void Produce() {
+        const char* begin;
+        const char* end;
+        while (true) {
+            size_t slot_id;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                slot_freed_.wait(lock, [&] { return stopping_ || !free_slots_.empty(); });
+                if (stopping_) { break; }
+                slot_id = free_slots_.back();
+                free_slots_.pop_back();
+            }
+            bool is_found = false;
+            std::exception_ptr error;
+            try {
+                is_found = locate_(&begin, &end);
+            }
+            catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& slot = slots_[slot_id];
+            if (error) {  // report it after the elements before it, then stop
+                slot.begin = file_.data();
+                slot.is_valid = false;
+                slot.error = error;
+                ordered_slots_[located_++ % ordered_slots_.size()] = slot_id;
+                MarkDone(slot_id);
+            }
+            else if (is_found) {
+                slot.begin = begin;
+                slot.end = end;
+                ordered_slots_[located_++ % ordered_slots_.size()] = slot_id;
+                tasks_.push(slot_id);
+                task_added_.notify_one();
+                continue;
+            }
+            else {
+                free_slots_.push_back(slot_id);
+            }
+            is_located_all_ = true;
+            slot_done_.notify_all();
+            break;
+        }
+    }
+
+    void Work() {
+        ElementParser parser;  // one per worker, keeps its buffers between elements
+        while (true) {
+            size_t slot_id;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                task_added_.wait(lock, [&] { return stopping_ || !tasks_.empty(); });
+                if (stopping_) { return; }
+                slot_id = tasks_.front();
+                tasks_.pop();
+            }
+            // only this worker touches the slot until it is marked done
+            auto& slot = slots_[slot_id];
+            slot.error = nullptr;
+            try {
+                slot.is_valid = decode_(parser, slot.begin, slot.end, slot.spectrum);
+            }
+            catch (...) {
+                slot.is_valid = false;
+                slot.error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            MarkDone(slot_id);
+        }
+    }
+};
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <memory>
+#include <algorithm>
+#include <cstring>
+#include <cstddef>
+
+// a buffer that is reused from one array to the next and only ever grows, so
+// that once it has reached the size of the largest array, decoding does not
+// touch the heap. unlike std::vector, growing it does not initialize the new
+// elements.
+template <typename T>
+class ScratchBuffer {
+public:
+    // room for at least size elements. the first keep elements are carried
+    // over if the buffer has to move, the rest is undefined.
+    T* Reserve(size_t size, size_t keep = 0) {
+        if (size > capacity_ || data_ == nullptr) {
+            if (size > owned_capacity_ || owned_ == nullptr) {
+                auto capacity = std::max({size, owned_capacity_ * 2, size_t(1)});
+                std::unique_ptr<T[]> data(new T[capacity]);
+                if (keep != 0) { memcpy(data.get(), data_, keep * sizeof(T)); }
+                owned_ = std::move(data);
+                owned_capacity_ = capacity;
+            }
+            else if (keep != 0 && data_ != owned_.get()) { memcpy(owned_.get(), data_, keep * sizeof(T)); }
+            data_ = owned_.get();
+            capacity_ = owned_capacity_;
+        }
+        return data_;
+    }
+
+    // use capacity elements at data, which someone else owns, until Reserve
+    // needs more. the buffer then goes back to its own memory.
+    void Borrow(T* data, size_t capacity) {
+        data_ = data;
+        capacity_ = capacity;
+    }
+
+    T* data() const { return data_; }
+    size_t capacity() const { return capacity_; }
+
+private:
+    T* data_ = nullptr;
+    size_t capacity_ = 0;
+    std::unique_ptr<T[]> owned_;
+    size_t owned_capacity_ = 0;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <string>
+#include <fstream>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstddef>
+#include <sys/stat.h>
+
+// size and modification time of a file, to tell whether an index written
+// for it is still valid.
+struct FileStamp {
+    uint64_t size;
+    int64_t mtime;
+
+    static FileStamp Of(const char* filename) {
+        struct stat st;
+        if (stat(filename, &st) != 0) { return FileStamp{0, 0}; }
+        return FileStamp{static_cast<uint64_t>(st.st_size), static_cast<int64_t>(st.st_mtime)};
+    }
+
+    bool operator==(const FileStamp& other) const { return size == other.size && mtime == other.mtime; }
+};
+
+// byte offsets of the spectrum elements of a file, in file order, with a
+// lookup by scan number for random access. an index built from the spectra
+// themselves also knows each element's length and header, and can be kept
+// next to the input as a sidecar file.
+class SpectrumIndex {
+public:
+    struct Entry {
+        unsigned scan_num;
+        unsigned ms_level;  // 0 when unknown or the spectrum is incomplete
+        unsigned precursor_charge;  // 0 when unknown or absent
+        uint32_t reserved = 0;  // the padding is spelled out, as entries are written raw
+        double precursor_mz;
+        uint64_t offset;  // of the '<' opening the element
+        uint64_t length;  // of the whole element, 0 when unknown
+    };
+    static_assert(sizeof(Entry) == 40, "the sidecar file stores entries as they are laid out in memory");
+
+    void Add(const Entry& entry) {
+        positions_[entry.scan_num] = entries_.size();
+        entries_.push_back(entry);
+    }
+
+    void Add(unsigned scan_num, size_t offset) {
+        Add(Entry{scan_num, 0, 0, 0, 0.0, offset, 0});
+    }
+
+    const Entry* Find(unsigned scan_num) const {
+        auto position = positions_.find(scan_num);
+        return position != positions_.end() ? &entries_[position->second] : nullptr;
+    }
+
+    void Clear() {
+        entries_.clear();
+        positions_.clear();
+    }
+
+    bool empty() const { return entries_.empty(); }
+    size_t size() const { return entries_.size(); }
+    const Entry& operator[](size_t i) const { return entries_[i]; }
+
+    // the sidecar file is a cache for this machine: entries are stored in
+    // native byte order, and any mismatch of magic, version or stamp makes
+    // Load fail so that the index is rebuilt.
+    bool Load(const std::string& path, const FileStamp& stamp) {
+        std::ifstream stream(path, std::ios::binary);
+        if (!stream) { return false; }
+        Header header;
+        if (!stream.read(reinterpret_cast<char*>(&header), sizeof(header))) { return false; }
+        if (0 != memcmp(header.magic, "MZLIDX\r\n", sizeof(header.magic)) || header.version != kVersion) { return false; }
+        if (!(FileStamp{header.file_size, header.file_mtime} == stamp)) { return false; }
+        if (header.entry_count > stamp.size) { return false; }  // cannot have more spectra than bytes
+        std::vector<Entry> entries(header.entry_count);
+        if (!stream.read(reinterpret_cast<char*>(entries.data()), entries.size() * sizeof(Entry))) { return false; }
+        Clear();
+        for (auto& entry : entries) { Add(entry); }
+        return true;
+    }
+
+    // failing to write the sidecar is not an error, the index is just
+    // rebuilt next time.
+    void Save(const std::string& path, const FileStamp& stamp) const {
+        std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+        if (!stream) { return; }
+        Header header;
+        memcpy(header.magic, "MZLIDX\r\n", sizeof(header.magic));
+        header.version = kVersion;
+        header.file_size = stamp.size;
+        header.file_mtime = stamp.mtime;
+        header.entry_count = entries_.size();
+        stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        stream.write(reinterpret_cast<const char*>(entries_.data()), entries_.size() * sizeof(Entry));
+        if (!stream) {  // do not leave a truncated index behind
+            stream.close();
+            remove(path.c_str());
+        }
+    }
+
+private:
+    static const uint32_t kVersion = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t reserved = 0;
+        uint64_t file_size;
+        int64_t file_mtime;
+        uint64_t entry_count;
+    };
+
+    std::vector<Entry> entries_;
+    std::unordered_map<unsigned, size_t> positions_;
+};
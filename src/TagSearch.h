@@ -0,0 +1,154 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MZLOADER_SSE2
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// helpers for locating xml elements in raw text without parsing it.
+// the search only looks at tag names, which is enough for the well-formed
+// files produced by converters (no tags hidden in comments or CDATA).
+
+inline bool IsTagNameEnd(char c) {
+    return c == ' ' || c == '>' || c == '/' || c == '\t' || c == '\n' || c == '\r';
+}
+
+inline unsigned CountTrailingZeros(unsigned mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+inline bool IsStartTagAt(const char* cursor, const char* end, const char* tag, size_t tag_size) {
+    return static_cast<size_t>(end - cursor) >= tag_size + 2 && 0 == strncmp(cursor + 1, tag, tag_size)
+           && IsTagNameEnd(cursor[tag_size + 1]);
+}
+
+// find the next "<tag" start tag in [begin, end), nullptr if there is none.
+// "<tagList" and alike do not match "<tag".
+inline const char* FindStartTag(const char* begin, const char* end, const char* tag) {
+    auto tag_size = strlen(tag);
+    auto cursor = begin;
+#ifdef MZLOADER_SSE2
+    // look at 16 positions at once, and only verify those where '<' is
+    // followed by the first letter of the tag. base64 payloads, which make
+    // up most of the file, never contain '<', so candidates are rare.
+    const __m128i open_bracket = _mm_set1_epi8('<');
+    const __m128i first_letter = _mm_set1_epi8(tag[0]);
+    for (; end - cursor > 16; cursor += 16) {
+        auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cursor));
+        auto next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cursor + 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(current, open_bracket),
+                                                        _mm_cmpeq_epi8(next, first_letter)));
+        for (; mask != 0; mask &= mask - 1) {
+            auto candidate = cursor + CountTrailingZeros(mask);
+            if (IsStartTagAt(candidate, end, tag, tag_size)) { return candidate; }
+        }
+    }
+#endif
+    for (; cursor < end; ++cursor) {
+        cursor = static_cast<const char*>(memchr(cursor, '<', end - cursor));
+        if (cursor == nullptr) { return nullptr; }
+        if (IsStartTagAt(cursor, end, tag, tag_size)) { return cursor; }
+    }
+    return nullptr;
+}
+
+// offsets of all "<tag" start tags in the text, in file order. the text is
+// split into one byte range per thread, each thread collects the tags that
+// start in its range, and the ranges are concatenated. tags that straddle a
+// range boundary belong to the range they start in.
+inline std::vector<size_t> FindAllStartTags(const char* text, size_t size, const char* tag, unsigned num_threads) {
+    const size_t kMinRangeSize = 4 * 1024 * 1024;  // not worth a thread below this
+    auto num_ranges = std::max<size_t>(1, std::min<size_t>(num_threads, size / kMinRangeSize));
+    auto range_size = size / num_ranges + 1;
+    auto text_end = text + size;
+    std::vector<std::vector<size_t>> range_offsets(num_ranges);
+    auto scan_range = [&](size_t range) {
+        auto range_begin = text + std::min(size, range * range_size);
+        auto range_end = text + std::min(size, (range + 1) * range_size);
+        for (auto tag_start = FindStartTag(range_begin, text_end, tag); tag_start != nullptr && tag_start < range_end;
+                tag_start = FindStartTag(tag_start + 1, text_end, tag)) {
+            range_offsets[range].push_back(tag_start - text);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (size_t range = 1; range < num_ranges; ++range) { threads.emplace_back(scan_range, range); }
+    scan_range(0);
+    for (auto& thread : threads) { thread.join(); }
+
+    std::vector<size_t> offsets;
+    for (auto& range : range_offsets) { offsets.insert(offsets.end(), range.begin(), range.end()); }
+    return offsets;
+}
+
+// given the start of a "<tag" element, return one past its closing tag, or
+// nullptr if the element is not complete in [start, end). elements with the
+// same name may be nested, as scans are in mzXML.
+inline const char* FindElementEnd(const char* start, const char* end, const char* tag) {
+    auto tag_size = strlen(tag);
+    int depth = 0;
+    for (auto cursor = start; cursor < end; ++cursor) {
+        cursor = static_cast<const char*>(memchr(cursor, '<', end - cursor));
+        if (cursor == nullptr || static_cast<size_t>(end - cursor) < tag_size + 3) { return nullptr; }
+        bool is_close = cursor[1] == '/';
+        auto name = cursor + (is_close ? 2 : 1);
+        if (0 != strncmp(name, tag, tag_size) || !IsTagNameEnd(name[tag_size])) { continue; }
+        auto tag_end = static_cast<const char*>(memchr(name, '>', end - name));
+        if (tag_end == nullptr) { return nullptr; }
+        if (is_close) { --depth; }
+        else if (tag_end[-1] != '/') { ++depth; }  // "<tag/>" opens and closes at once
+        if (depth == 0) { return tag_end + 1; }
+        cursor = tag_end;
+    }
+    return nullptr;
+}
+
+// value of attribute attr in the start tag beginning at tag_start, as a
+// [begin, end) range. returns false if the tag has no such attribute.
+inline bool FindTagAttribute(const char* tag_start, const char* end, const char* attr,
+                             const char** value_begin, const char** value_end) {
+    auto tag_end = static_cast<const char*>(memchr(tag_start, '>', end - tag_start));
+    if (tag_end == nullptr) { return false; }
+    auto attr_size = strlen(attr);
+    for (auto cursor = tag_start; cursor + attr_size + 2 < tag_end; ++cursor) {
+        // the name must stand alone: " id=" is not part of " nativeid=".
+        if (IsTagNameEnd(cursor[0]) && 0 == strncmp(cursor + 1, attr, attr_size)
+                && cursor[attr_size + 1] == '=' && cursor[attr_size + 2] == '"') {
+            *value_begin = cursor + attr_size + 3;
+            *value_end = static_cast<const char*>(memchr(*value_begin, '"', tag_end - *value_begin));
+            return *value_end != nullptr;
+        }
+    }
+    return false;
+}
+
+// read the number enclosed in the last "<tag>...</tag>" of the file, such as
+// the indexListOffset of indexedmzML. only the tail of the file is searched.
+inline bool FindTrailingNumber(const char* text, size_t size, const char* tag, size_t* number) {
+    const size_t kTailSize = 4096;
+    auto tail = size > kTailSize ? text + size - kTailSize : text;
+    auto tag_size = strlen(tag);
+    for (auto cursor = text + size; cursor-- > tail; ) {
+        if (*cursor == '<' && static_cast<size_t>(text + size - cursor) > tag_size + 2
+                && 0 == strncmp(cursor + 1, tag, tag_size) && cursor[tag_size + 1] == '>') {
+            char* number_end;
+            *number = strtoull(cursor + tag_size + 2, &number_end, 10);
+            return number_end != cursor + tag_size + 2;
+        }
+    }
+    return false;
+}
@@ -1,7 +1,24 @@
 #include "Decode.h"  // internal header
+#include "Centroid.h"  // internal header
+#include "MappedFile.h"  // internal header
+#include "TagSearch.h"  // internal header
+#include "Cache.h"  // internal header
 #include "MzLoader.h"
 #include <gtest/gtest.h>
+extern "C" {
+#include <b64/cdecode.h>
+#include <b64/cencode.h>
+}
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <algorithm>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 
 #define alloc_func rapidxml_alloc_func
 #include <rapidxml.hpp>
@@ -98,6 +115,458 @@ TEST(Unittest_MzLoader, Compressed32BitMzml) {
     EXPECT_TRUE(test_file.eof());
 }
 
+TEST(Unittest_MzLoader, Base64Kernels) {
+    const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    srand(7);
+    for (int round = 0; round < 200; ++round) {
+        std::string text;
+        auto length = rand() % 1000;
+        for (int i = 0; i < length; ++i) {
+            auto r = rand() % 100;
+            if (round % 2 == 0 || r > 2) { text += alphabet[rand() % 64]; }  // every other round is clean base64
+            else if (r == 0) { text += '\n'; }
+            else if (r == 1) { text += '='; }
+            else { text += static_cast<char>(0x80 + rand() % 128); }
+        }
+        vector<char> expected((text.size() + 3) / 4 * 3 + 1);
+        base64_decodestate state;
+        base64_init_decodestate(&state);
+        auto expected_size = base64_decode_block(text.data(), text.size(), expected.data(), &state);
+        for (auto kernel : {Base64Kernel::kScalar, Base64Kernel::kSse41, Base64Kernel::kAvx2, Base64Kernel::kAvx512Vbmi}) {
+            if (!IsBase64KernelSupported(kernel)) { continue; }
+            vector<char> decoded((text.size() + 3) / 4 * 3 + 1);
+            auto decoded_size = DecodeBase64(text.data(), text.size(), decoded.data(), kernel);
+            ASSERT_EQ(expected_size, decoded_size);
+            EXPECT_TRUE(std::equal(expected.begin(), expected.begin() + expected_size, decoded.begin()));
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, ConvertKernels) {
+    vector<double> values;
+    for (int i = 0; i < 37; ++i) { values.push_back(i * 1.25 - 7.5); }  // exact in float as well
+    for (bool little_endian : {true, false}) {
+        for (int precision : {32, 64}) {
+            vector<char> data;
+            for (auto value : values) {
+                char bytes[8];
+                if (precision == 64) { memcpy(bytes, &value, 8); }
+                else { float float_value = static_cast<float>(value); memcpy(bytes, &float_value, 4); }
+                if (!little_endian) { std::reverse(bytes, bytes + precision / 8); }
+                data.insert(data.end(), bytes, bytes + precision / 8);
+            }
+            for (auto kernel : {ConvertKernel::kScalar, ConvertKernel::kAvx2}) {
+                if (!IsConvertKernelSupported(kernel)) { continue; }
+                vector<double> converted(values.size());
+                ConvertValues(data.data(), values.size(), precision, little_endian, converted.data(), kernel);
+                EXPECT_EQ(values, converted);
+            }
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, DecompressSizeHint) {
+    vector<char> plain(100000);
+    for (size_t i = 0; i < plain.size(); ++i) { plain[i] = static_cast<char>(i * i % 97); }
+    vector<unsigned char> compressed(compressBound(plain.size()));
+    uLongf compressed_size = compressed.size();
+    ASSERT_EQ(Z_OK, compress(compressed.data(), &compressed_size, reinterpret_cast<const Bytef*>(plain.data()), plain.size()));
+    for (auto backend : {InflateBackend::kZlib, InflateBackend::kOneShot}) {
+        // exact, unknown, too small and too large sizes all inflate the same data
+        for (unsigned long expected_len : {100000ul, 0ul, 1ul, 12345ul, 300000ul}) {
+            ScratchBuffer<char> dest;
+            auto dest_len = decompress(reinterpret_cast<const char*>(compressed.data()), compressed_size, expected_len,
+                                       dest, backend);
+            ASSERT_EQ(plain.size(), dest_len);
+            EXPECT_EQ(0, memcmp(plain.data(), dest.data(), dest_len));
+        }
+        ScratchBuffer<char> dest;
+        EXPECT_THROW(decompress(reinterpret_cast<const char*>(compressed.data()), compressed_size / 2, plain.size(),
+                                dest, backend), std::runtime_error);
+    }
+}
+
+TEST(Unittest_MzLoader, OneShotInflater) {
+    std::unique_ptr<OneShotInflater> inflater(new OneShotInflater);
+    int resumed_rounds = 0;  // that kept the output of earlier blocks
+    srand(11);
+    for (int round = 0; round < 60; ++round) {
+        // text-like, random and m/z-like data, compressed with every kind of block
+        vector<unsigned char> plain(rand() % 100000);
+        for (size_t i = 0; i < plain.size(); ++i) {
+            if (round % 3 == 0) { plain[i] = "ACGT"[rand() % 4]; }
+            else if (round % 3 == 1) { plain[i] = static_cast<unsigned char>(rand()); }
+            else { double mz = 100.0 + i / 8 * 0.01; plain[i] = reinterpret_cast<unsigned char*>(&mz)[i % 8]; }
+        }
+        int level = round % 10;
+        int strategy = round % 4 == 3 ? Z_FIXED : Z_DEFAULT_STRATEGY;
+        z_stream stream = {};
+        ASSERT_EQ(Z_OK, deflateInit2(&stream, level, Z_DEFLATED, 15, 8, strategy));
+        vector<unsigned char> compressed(deflateBound(&stream, plain.size()));
+        stream.next_in = plain.data();
+        stream.avail_in = plain.size();
+        stream.next_out = compressed.data();
+        stream.avail_out = compressed.size();
+        ASSERT_EQ(Z_STREAM_END, deflate(&stream, Z_FINISH));
+        compressed.resize(stream.total_out);
+        deflateEnd(&stream);
+
+        vector<unsigned char> out(plain.size() + 1);
+        size_t out_size = 0;
+        ASSERT_EQ(OneShotInflater::Result::kOk,
+                  inflater->Inflate(compressed.data(), compressed.size(), out.data(), out.size(), &out_size));
+        ASSERT_EQ(plain.size(), out_size);
+        EXPECT_TRUE(std::equal(plain.begin(), plain.end(), out.begin()));
+        if (!plain.empty()) {
+            EXPECT_EQ(OneShotInflater::Result::kShortOutput,
+                      inflater->Inflate(compressed.data(), compressed.size(), out.data(), plain.size() - 1, &out_size));
+            EXPECT_LE(inflater->BlockOutSize(), plain.size() - 1);
+            if (inflater->BlockOutSize() != 0) { ++resumed_rounds; }
+
+            // zlib takes over at the block that did not fit, and checks the whole output
+            ScratchBuffer<char> dest;
+            auto source = reinterpret_cast<const char*>(compressed.data());
+            ASSERT_EQ(plain.size(), decompress(source, compressed.size(), plain.size() - 1, dest, InflateBackend::kOneShot));
+            EXPECT_TRUE(std::equal(plain.begin(), plain.end(), reinterpret_cast<unsigned char*>(dest.data())));
+            compressed[compressed.size() - 1] ^= 1;  // checksum mismatch
+            EXPECT_EQ(OneShotInflater::Result::kDataError,
+                      inflater->Inflate(compressed.data(), compressed.size(), out.data(), out.size(), &out_size));
+            EXPECT_THROW(decompress(source, compressed.size(), plain.size() - 1, dest, InflateBackend::kOneShot),
+                         std::runtime_error);
+        }
+    }
+    EXPECT_LT(0, resumed_rounds);
+}
+
+TEST(Unittest_MzLoader, OneShotInflaterAgreesWithZlib) {
+    // broken streams either fail with both engines or inflate to the same bytes
+    srand(23);
+    int broken_rounds = 0;
+    for (int round = 0; round < 400; ++round) {
+        vector<unsigned char> plain(rand() % 20000);
+        for (size_t i = 0; i < plain.size(); ++i) {
+            plain[i] = round % 2 == 0 ? "ACGT"[rand() % 4] : static_cast<unsigned char>(rand());
+        }
+        vector<unsigned char> compressed(compressBound(plain.size()));
+        uLongf compressed_size = compressed.size();
+        ASSERT_EQ(Z_OK, compress2(compressed.data(), &compressed_size, plain.data(), plain.size(), round % 10));
+        compressed.resize(compressed_size);
+        if (round % 4 == 3) { compressed.resize(rand() % compressed.size()); }  // truncated
+        else {
+            for (int flip = rand() % 4; flip >= 0; --flip) {
+                compressed[rand() % compressed.size()] ^= static_cast<unsigned char>(1 << rand() % 8);
+            }
+        }
+        auto source = reinterpret_cast<const char*>(compressed.data());
+        for (size_t expected_len : {plain.size(), plain.size() / 2 + 1}) {
+            ScratchBuffer<char> zlib_dest, one_shot_dest;
+            size_t zlib_len = 0, one_shot_len = 0;
+            bool is_zlib_ok = true, is_one_shot_ok = true;
+            try { zlib_len = decompress(source, compressed.size(), expected_len, zlib_dest, InflateBackend::kZlib); }
+            catch (const std::runtime_error&) { is_zlib_ok = false; }
+            try {
+                one_shot_len = decompress(source, compressed.size(), expected_len, one_shot_dest, InflateBackend::kOneShot);
+            }
+            catch (const std::runtime_error&) { is_one_shot_ok = false; }
+            ASSERT_EQ(is_zlib_ok, is_one_shot_ok) << "round " << round;
+            if (!is_zlib_ok) { ++broken_rounds; continue; }
+            ASSERT_EQ(zlib_len, one_shot_len) << "round " << round;
+            EXPECT_EQ(0, memcmp(zlib_dest.data(), one_shot_dest.data(), zlib_len)) << "round " << round;
+        }
+    }
+    EXPECT_LT(400, broken_rounds);  // most of them are caught
+}
+
+// numpress encoders as in the reference implementation, MSNumpress.cpp
+static void AppendNumpressInt(uint32_t x, vector<unsigned char>& half_bytes) {
+    const uint32_t mask = 0xF0000000u;
+    unsigned skipped = 0;
+    if ((x & mask) == 0) {
+        for (skipped = 0; skipped < 8 && (x & (mask >> (4 * skipped))) == 0; ++skipped) {}
+        half_bytes.push_back(skipped);
+    }
+    else if ((x & mask) == mask) {
+        for (skipped = 0; skipped < 7 && (x & (mask >> (4 * skipped))) == (mask >> (4 * skipped)); ++skipped) {}
+        half_bytes.push_back(skipped + 8);
+    }
+    else {
+        half_bytes.push_back(0);
+    }
+    for (unsigned i = skipped; i < 8; ++i) { half_bytes.push_back((x >> (4 * (i - skipped))) & 0x0F); }
+}
+
+static void AppendHalfBytes(const vector<unsigned char>& half_bytes, vector<unsigned char>& bytes) {
+    for (size_t i = 0; i < half_bytes.size(); i += 2) {
+        bytes.push_back(half_bytes[i] << 4 | (i + 1 < half_bytes.size() ? half_bytes[i + 1] : 0));
+    }
+}
+
+static vector<unsigned char> NumpressFixedPointBytes(double fixed_point) {
+    vector<unsigned char> bytes(8);
+    auto fp = reinterpret_cast<unsigned char*>(&fixed_point);
+    for (int i = 0; i < 8; ++i) { bytes[i] = fp[7 - i]; }
+    return bytes;
+}
+
+static vector<unsigned char> EncodeNumpressLinear(const vector<double>& values, double fixed_point) {
+    auto bytes = NumpressFixedPointBytes(fixed_point);
+    vector<unsigned char> half_bytes;
+    int64_t ints[3] = {0, 0, 0};
+    for (size_t i = 0; i < values.size(); ++i) {
+        ints[0] = ints[1];
+        ints[1] = ints[2];
+        ints[2] = static_cast<int64_t>(values[i] * fixed_point + 0.5);
+        if (i < 2) {
+            for (int j = 0; j < 4; ++j) { bytes.push_back((ints[2] >> (8 * j)) & 0xFF); }
+            continue;
+        }
+        auto extrapolation = ints[1] + (ints[1] - ints[0]);
+        AppendNumpressInt(static_cast<uint32_t>(ints[2] - extrapolation), half_bytes);
+    }
+    AppendHalfBytes(half_bytes, bytes);
+    return bytes;
+}
+
+static vector<unsigned char> EncodeNumpressPic(const vector<double>& values) {
+    vector<unsigned char> bytes, half_bytes;
+    for (auto value : values) { AppendNumpressInt(static_cast<uint32_t>(value + 0.5), half_bytes); }
+    AppendHalfBytes(half_bytes, bytes);
+    return bytes;
+}
+
+static vector<unsigned char> EncodeNumpressSlof(const vector<double>& values, double fixed_point) {
+    auto bytes = NumpressFixedPointBytes(fixed_point);
+    for (auto value : values) {
+        auto stored = static_cast<unsigned short>(log(value + 1) * fixed_point + 0.5);
+        bytes.push_back(stored & 0xFF);
+        bytes.push_back(stored >> 8);
+    }
+    return bytes;
+}
+
+TEST(Unittest_MzLoader, NumpressCodecs) {
+    srand(5);
+    for (size_t size : {0u, 1u, 2u, 3u, 7u, 100u, 5000u}) {
+        // m/z-like values with gaps, so differences take from 1 to 9 half bytes
+        vector<double> mz_values(size), intensity_values(size);
+        double mz = 150.0;
+        for (size_t i = 0; i < size; ++i) {
+            mz += rand() % 4 == 0 ? rand() % 100 * 0.7 : 0.001 * (rand() % 50);
+            mz_values[i] = mz;
+            intensity_values[i] = rand() % 3 == 0 ? 0.0 : std::pow(10.0, rand() % 80 / 10.0);
+        }
+        vector<double> out(NumpressMaxValues(NumpressCodec::kPic, 10 * size + 16));
+
+        const double kLinearFixedPoint = 1e6;
+        auto linear = EncodeNumpressLinear(mz_values, kLinearFixedPoint);
+        ASSERT_EQ(size, DecodeNumpressLinear(linear.data(), linear.size(), out.data()));
+        for (size_t i = 0; i < size; ++i) { EXPECT_NEAR(mz_values[i], out[i], 1 / kLinearFixedPoint); }
+
+        auto pic = EncodeNumpressPic(intensity_values);
+        ASSERT_EQ(size, DecodeNumpressPic(pic.data(), pic.size(), out.data()));
+        for (size_t i = 0; i < size; ++i) { EXPECT_EQ(std::floor(intensity_values[i] + 0.5), out[i]); }
+
+        const double kSlofFixedPoint = 3000;
+        auto slof = EncodeNumpressSlof(intensity_values, kSlofFixedPoint);
+        ASSERT_EQ(size, DecodeNumpressSlof(slof.data(), slof.size(), out.data()));
+        for (size_t i = 0; i < size; ++i) {
+            auto stored = static_cast<unsigned short>(log(intensity_values[i] + 1) * kSlofFixedPoint + 0.5);
+            EXPECT_EQ(exp(stored / kSlofFixedPoint) - 1, out[i]);
+        }
+    }
+    // a difference that claims more half bytes than are left
+    vector<unsigned char> broken = EncodeNumpressPic({123456789.0});
+    broken.pop_back();
+    vector<double> out(16);
+    EXPECT_THROW(DecodeNumpressPic(broken.data(), broken.size(), out.data()), std::runtime_error);
+}
+
+static std::string EncodeBase64(const vector<unsigned char>& bytes) {
+    std::string text(bytes.size() * 2 + 8, '\0');
+    base64_encodestate state;
+    base64_init_encodestate(&state);
+    auto size = base64_encode_block(reinterpret_cast<const char*>(bytes.data()), bytes.size(), &text[0], &state);
+    size += base64_encode_blockend(&text[size], &state);
+    text.resize(size);
+    return text;
+}
+
+static vector<unsigned char> Compress(const vector<unsigned char>& bytes) {
+    vector<unsigned char> compressed(compressBound(bytes.size()));
+    uLongf compressed_size = compressed.size();
+    compress(compressed.data(), &compressed_size, bytes.data(), bytes.size());
+    compressed.resize(compressed_size);
+    return compressed;
+}
+
+// a <binaryDataArray> with the given cvParam names, separated by '\0' and
+// ending with an empty one
+static std::string BinaryDataArray(const char* terms, const char* array_name, const vector<unsigned char>& data) {
+    std::string text = "<binaryDataArray>";
+    for (auto term = terms; *term != '\0'; term += strlen(term) + 1) {
+        text += std::string("<cvParam name=\"") + term + "\" value=\"\"/>";
+    }
+    return text + "<cvParam name=\"" + array_name + "\" value=\"\"/><binary>" + EncodeBase64(data)
+           + "</binary></binaryDataArray>";
+}
+
+// an mzML ms2 spectrum element with the given arrays
+static std::string SpectrumMzml(unsigned scan_num, const std::string& spectrum_params,
+                                const std::string& binary_data_arrays, const std::string& spectrum_attributes = "") {
+    return "<spectrum id=\"scan=" + std::to_string(scan_num) + "\"" + spectrum_attributes + ">"
+           + "<cvParam name=\"ms level\" value=\"2\"/><cvParam name=\"base peak m/z\" value=\"1\"/>"
+           + "<cvParam name=\"base peak intensity\" value=\"1\"/><cvParam name=\"total ion current\" value=\"1\"/>"
+           + spectrum_params + "<precursorList><precursor><selectedIonList><selectedIon>"
+           + "<cvParam name=\"selected ion m/z\" value=\"500\"/><cvParam name=\"charge state\" value=\"2\"/>"
+           + "</selectedIon></selectedIonList></precursor></precursorList><binaryDataArrayList>"
+           + binary_data_arrays + "</binaryDataArrayList></spectrum>";
+}
+
+// an mzML file holding one ms2 spectrum with the given arrays
+static void WriteSpectrumMzml(const char* filename, unsigned scan_num, const std::string& spectrum_params,
+                              const std::string& binary_data_arrays, const std::string& spectrum_attributes = "") {
+    std::ofstream(filename) << "<mzML><run><spectrumList>"
+                            << SpectrumMzml(scan_num, spectrum_params, binary_data_arrays, spectrum_attributes)
+                            << "</spectrumList></run></mzML>";
+}
+
+TEST(Unittest_MzLoader, NumpressMzml) {
+    MzLoader reference_loader("small_charge.mzML");
+    MzLoader::Spectrum reference;
+    ASSERT_TRUE(reference_loader.LoadScan(11, reference));
+    vector<double> mz_values, intensity_values;
+    for (auto& peak : reference.peaks) {
+        mz_values.push_back(peak.first);
+        intensity_values.push_back(peak.second);
+    }
+    const double kLinearFixedPoint = 1e5;
+    const double kSlofFixedPoint = 2000;
+    auto linear = EncodeNumpressLinear(mz_values, kLinearFixedPoint);
+    auto pic = EncodeNumpressPic(intensity_values);
+    auto slof = EncodeNumpressSlof(intensity_values, kSlofFixedPoint);
+    // codec terms of the m/z array, of the intensity array, and the intensity data
+    const struct { const char* mz_terms; const char* intensity_terms; vector<unsigned char> mz, intensity; bool is_slof; }
+            cases[] = {
+        {"MS-Numpress linear prediction compression\0", "MS-Numpress positive integer compression\0", linear, pic, false},
+        {"MS-Numpress linear prediction compression followed by zlib compression\0",
+         "MS-Numpress short logged float compression followed by zlib compression\0",
+         Compress(linear), Compress(slof), true},
+        {"MS-Numpress linear prediction compression\0zlib compression\0",  // zlib as a term of its own
+         "zlib compression\0MS-Numpress short logged float compression\0",
+         Compress(linear), Compress(slof), true},
+    };
+    for (auto& numpress_case : cases) {
+        WriteSpectrumMzml("numpress.mzML", 11, "",
+                          BinaryDataArray(numpress_case.mz_terms, "m/z array", numpress_case.mz)
+                          + BinaryDataArray(numpress_case.intensity_terms, "intensity array", numpress_case.intensity));
+        MzLoader loader("numpress.mzML");
+        MzLoader::Spectrum spectrum;
+        ASSERT_TRUE(loader.LoadNext(spectrum));
+        EXPECT_EQ(11u, spectrum.scan_num);
+        ASSERT_EQ(reference.peaks.size(), spectrum.peaks.size());
+        for (size_t i = 0; i < spectrum.peaks.size(); ++i) {
+            EXPECT_NEAR(reference.peaks[i].first, spectrum.peaks[i].first, 1 / kLinearFixedPoint);
+            auto intensity = reference.peaks[i].second;
+            if (numpress_case.is_slof) {  // within the 16-bit resolution of the logarithm
+                EXPECT_NEAR(log(intensity + 1), log(spectrum.peaks[i].second + 1), 1 / kSlofFixedPoint);
+            }
+            else { EXPECT_EQ(std::floor(intensity + 0.5), spectrum.peaks[i].second); }
+        }
+        EXPECT_FALSE(loader.LoadNext(spectrum));
+    }
+    remove("numpress.mzML");
+}
+
+// gaussian peaks sampled every 0.002 m/z, with stretches of zeros between
+// them as profile data has
+static void ProfilePeaks(const vector<std::pair<double, double>>& centers, vector<double>* mz_values,
+                         vector<double>* intensity_values) {
+    const double kStep = 0.002;
+    const double kWidth = 0.004;
+    for (auto& center : centers) {
+        for (int i = -12; i <= 12; ++i) {
+            auto mz = center.first + (i + 0.3) * kStep;  // off the grid, so the apex is interpolated
+            mz_values->push_back(mz);
+            auto offset = (mz - center.first) / kWidth;
+            intensity_values->push_back(std::abs(i) == 12 ? 0.0 : center.second * exp(-0.5 * offset * offset));
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, Centroid) {
+    const vector<std::pair<double, double>> centers = {{200.1, 1000}, {350.25, 50}, {350.4, 7000}, {999.9, 3}};
+    vector<double> mz_values, intensity_values;
+    ProfilePeaks(centers, &mz_values, &intensity_values);
+    auto profile_intensity_values = intensity_values;
+    auto count = CentroidPeaks(mz_values.data(), intensity_values.data(), mz_values.size(), 1);
+    ASSERT_EQ(centers.size(), count);
+    size_t profile_start = 0;
+    for (size_t i = 0; i < count; ++i) {
+        EXPECT_NEAR(centers[i].first, mz_values[i], 0.0002);
+        double sum = 0;
+        for (size_t j = profile_start; j < profile_start + 25; ++j) { sum += profile_intensity_values[j]; }
+        EXPECT_DOUBLE_EQ(sum, intensity_values[i]);
+        profile_start += 25;
+    }
+
+    // interleaved as in mzXML
+    vector<double> pairs = {100.0, 1.0, 100.1, 3.0, 100.2, 2.0, 100.3, 0.0, 100.4, 5.0};
+    ASSERT_EQ(2u, CentroidPeaks(pairs.data(), pairs.data() + 1, 5, 2));
+    EXPECT_GT(pairs[0], 100.1);
+    EXPECT_LT(pairs[0], 100.15);
+    EXPECT_EQ(6.0, pairs[1]);
+    EXPECT_EQ(100.4, pairs[2]);
+    EXPECT_EQ(5.0, pairs[3]);
+
+    // through the loader, which only centroids profile spectra
+    auto bytes = [](const vector<double>& values) {
+        auto data = reinterpret_cast<const unsigned char*>(values.data());
+        return vector<unsigned char>(data, data + values.size() * sizeof(double));
+    };
+    mz_values.clear();
+    intensity_values.clear();
+    ProfilePeaks(centers, &mz_values, &intensity_values);
+    auto arrays = BinaryDataArray("64-bit float\0no compression\0", "m/z array", bytes(mz_values))
+                  + BinaryDataArray("64-bit float\0no compression\0", "intensity array", bytes(intensity_values));
+    for (auto spectrum_params : {"<cvParam name=\"profile spectrum\" value=\"\"/>",
+                                 "<cvParam name=\"centroid spectrum\" value=\"\"/>"}) {
+        WriteSpectrumMzml("profile.mzML", 1, spectrum_params, arrays);
+        bool is_profile = strstr(spectrum_params, "profile") != nullptr;
+        for (unsigned num_threads : {1u, 2u}) {
+            MzLoader::LoadOptions options;
+            options.centroid = true;
+            options.num_threads = num_threads;
+            options.filter.min_mz = 300;
+            options.filter.top_n = 2;
+            MzLoader loader("profile.mzML", options);
+            MzLoader::Spectrum spectrum;
+            ASSERT_TRUE(loader.LoadNext(spectrum));
+            if (is_profile) {  // the filter picks from the centroids
+                ASSERT_EQ(2u, spectrum.peaks.size());
+                EXPECT_NEAR(350.25, spectrum.peaks[0].first, 0.0002);
+                EXPECT_NEAR(350.4, spectrum.peaks[1].first, 0.0002);
+            }
+            else { EXPECT_EQ(2u, spectrum.peaks.size()); }  // the two most intense profile points
+        }
+    }
+    remove("profile.mzML");
+}
+
+TEST(Unittest_MzLoader, MappedFile) {
+    MappedFile mapped_file("small_zlib.pwiz.1.1.mzML", 4096);  // release every page
+    rapidxml::file<> reference_file("small_zlib.pwiz.1.1.mzML");
+    ASSERT_EQ(reference_file.size() - 1, mapped_file.size());  // rapidxml::file counts the terminator
+    EXPECT_EQ(0, memcmp(reference_file.data(), mapped_file.data(), mapped_file.size()));
+    EXPECT_EQ('\0', mapped_file.data()[mapped_file.size()]);
+    mapped_file.Release(mapped_file.size() / 2);
+    mapped_file.Release(mapped_file.size());  // released pages are re-read on access
+#ifndef _WIN32
+    EXPECT_LT(mapped_file.size() - 65536, mapped_file.released());
+#endif
+    EXPECT_EQ(0, memcmp(reference_file.data(), mapped_file.data(), mapped_file.size()));
+    EXPECT_EQ('\0', mapped_file.data()[mapped_file.size()]);
+}
+
 // real data validation, PASS!
 TEST(Unittest_MzLoader, MzmlAPI) {
     MzLoader loader("OR20080527_S_mix8FTFTprof-prof_03.1294.mzML");
@@ -137,6 +606,855 @@ TEST(Unittest_MzLoader, MzxmlAPI) {
     EXPECT_TRUE(test_file.eof());
 }
 
+TEST(Unittest_MzLoader, MzmlMzxmlAgree) {
+    MzLoader mzml_loader("small_charge.mzML");  // same spectra, stored in both formats
+    MzLoader mzxml_loader("small_charge.mzXML");
+    MzLoader::Spectrum mzml_spectrum, mzxml_spectrum;
+    unsigned spectrum_count = 0;
+    while (mzml_loader.LoadNext(mzml_spectrum)) {
+        ASSERT_TRUE(mzxml_loader.LoadNext(mzxml_spectrum));
+        EXPECT_EQ(mzml_spectrum.scan_num, mzxml_spectrum.scan_num);
+        EXPECT_EQ(mzml_spectrum.precursor_charge, mzxml_spectrum.precursor_charge);
+        EXPECT_DOUBLE_EQ(mzml_spectrum.precursor_mz, mzxml_spectrum.precursor_mz);
+        ASSERT_EQ(mzml_spectrum.peaks.size(), mzxml_spectrum.peaks.size());
+        for (size_t i = 0; i < mzml_spectrum.peaks.size(); ++i) {
+            EXPECT_FLOAT_EQ(mzml_spectrum.peaks[i].first, mzxml_spectrum.peaks[i].first);
+            EXPECT_FLOAT_EQ(mzml_spectrum.peaks[i].second, mzxml_spectrum.peaks[i].second);
+        }
+        ++spectrum_count;
+    }
+    EXPECT_FALSE(mzxml_loader.LoadNext(mzxml_spectrum));
+    EXPECT_EQ(10u, spectrum_count);  // all ms2 spectra
+}
+
+TEST(Unittest_MzLoader, StreamingMzml) {
+    MzLoader::LoadOptions options;
+    options.streaming = true;
+    MzLoader stream_loader("small_charge.mzML", options);
+    MzLoader dom_loader("small_charge.mzML");
+    MzLoader::Spectrum stream_spectrum, dom_spectrum;
+    while (dom_loader.LoadNext(dom_spectrum)) {
+        ASSERT_TRUE(stream_loader.LoadNext(stream_spectrum));
+        EXPECT_EQ(dom_spectrum.scan_num, stream_spectrum.scan_num);
+        EXPECT_EQ(dom_spectrum.precursor_charge, stream_spectrum.precursor_charge);
+        EXPECT_EQ(dom_spectrum.total_ion_current, stream_spectrum.total_ion_current);
+        EXPECT_TRUE(dom_spectrum.peaks == stream_spectrum.peaks);
+    }
+    EXPECT_FALSE(stream_loader.LoadNext(stream_spectrum));
+}
+
+TEST(Unittest_MzLoader, LoadScan) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        MzLoader sequential_loader(filename);
+        MzLoader random_loader(filename);
+        MzLoader::Spectrum sequential_spectrum, random_spectrum;
+        while (sequential_loader.LoadNext(sequential_spectrum)) {
+            ASSERT_TRUE(random_loader.LoadScan(sequential_spectrum.scan_num, random_spectrum));
+            EXPECT_EQ(sequential_spectrum.scan_num, random_spectrum.scan_num);
+            EXPECT_EQ(sequential_spectrum.precursor_mz, random_spectrum.precursor_mz);
+            EXPECT_TRUE(sequential_spectrum.peaks == random_spectrum.peaks);
+        }
+        EXPECT_FALSE(random_loader.LoadScan(1, random_spectrum));  // ms1
+        EXPECT_FALSE(random_loader.LoadScan(1000, random_spectrum));  // no such scan
+        EXPECT_TRUE(random_loader.LoadNext(random_spectrum));  // LoadNext position is untouched
+        EXPECT_EQ(3u, random_spectrum.scan_num);
+    }
+}
+
+TEST(Unittest_MzLoader, LoadScanWithoutIndex) {
+    std::ifstream indexed_file("small_charge.mzML", std::ios::binary);
+    std::string text((std::istreambuf_iterator<char>(indexed_file)), std::istreambuf_iterator<char>());
+    auto mzml_start = text.find("<mzML"), mzml_end = text.find("</mzML>") + 7;
+    text = text.substr(mzml_start, mzml_end - mzml_start);  // plain mzML without the indexedmzML wrapper
+    std::ofstream("small_charge.noindex.mzML", std::ios::binary) << text;
+    {
+        MzLoader loader("small_charge.noindex.mzML");
+        MzLoader::Spectrum spectrum;
+        ASSERT_TRUE(loader.LoadScan(11, spectrum));
+        EXPECT_EQ(11u, spectrum.scan_num);
+        EXPECT_EQ(4u, spectrum.precursor_charge);
+    }
+    remove("small_charge.noindex.mzML");
+}
+
+TEST(Unittest_MzLoader, IndexFile) {
+    for (std::string filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        auto index_path = filename + ".mzlidx";
+        remove(index_path.c_str());
+        MzLoader::LoadOptions options;
+        options.use_index_file = true;
+        for (auto pass = 0; pass < 2; ++pass) {  // write the index file, then read it
+            MzLoader indexed_loader(filename.c_str(), options);
+            EXPECT_TRUE(std::ifstream(index_path).good());
+            MzLoader plain_loader(filename.c_str());
+            MzLoader::Spectrum indexed_spectrum, plain_spectrum;
+            while (plain_loader.LoadNext(plain_spectrum)) {
+                ASSERT_TRUE(indexed_loader.LoadNext(indexed_spectrum));
+                EXPECT_EQ(plain_spectrum.scan_num, indexed_spectrum.scan_num);
+                EXPECT_TRUE(plain_spectrum.peaks == indexed_spectrum.peaks);
+            }
+            EXPECT_FALSE(indexed_loader.LoadNext(indexed_spectrum));
+            ASSERT_TRUE(indexed_loader.LoadScan(11, indexed_spectrum));
+            EXPECT_EQ(4u, indexed_spectrum.precursor_charge);
+        }
+        // a 40-byte header, then 40-byte entries whose bytes 12-15 are reserved and written as zeros
+        std::ifstream index_file(index_path, std::ios::binary);
+        std::string index_bytes((std::istreambuf_iterator<char>(index_file)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(0u, index_bytes.size() % 40);
+        ASSERT_LT(40u, index_bytes.size());
+        for (size_t entry = 40; entry < index_bytes.size(); entry += 40) {
+            EXPECT_EQ(std::string(4, '\0'), index_bytes.substr(entry + 12, 4));
+        }
+        index_file.close();
+        remove(index_path.c_str());
+    }
+}
+
+TEST(Unittest_MzLoader, ParallelDecoding) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML", "small_nested.mzXML"}) {
+        for (unsigned num_threads : {2u, 7u}) {
+            MzLoader::LoadOptions options;
+            options.num_threads = num_threads;
+            MzLoader parallel_loader(filename, options);
+            MzLoader serial_loader(filename);
+            MzLoader::Spectrum parallel_spectrum, serial_spectrum;
+            while (serial_loader.LoadNext(serial_spectrum)) {
+                ASSERT_TRUE(parallel_loader.LoadNext(parallel_spectrum));
+                EXPECT_EQ(serial_spectrum.scan_num, parallel_spectrum.scan_num);  // still in file order
+                EXPECT_TRUE(serial_spectrum.peaks == parallel_spectrum.peaks);
+            }
+            EXPECT_FALSE(parallel_loader.LoadNext(parallel_spectrum));
+        }
+    }
+    MzLoader::LoadOptions options;
+    options.num_threads = 4;
+    MzLoader abandoned_loader("small_charge.mzML", options);  // destroyed with work in flight
+    MzLoader::Spectrum spectrum;
+    EXPECT_TRUE(abandoned_loader.LoadNext(spectrum));
+}
+
+TEST(Unittest_MzLoader, NestedScans) {
+    // the scans of small_charge.mzXML, with 3 and 4 nested in 2, 10 in 9 and 11 in 10
+    MzLoader flat_loader("small_charge.mzXML");
+    MzLoader::Spectrum flat_spectrum, nested_spectrum;
+    vector<MzLoader::Spectrum> flat_spectra;
+    while (flat_loader.LoadNext(flat_spectrum)) { flat_spectra.push_back(flat_spectrum); }
+    for (int mode = 0; mode < 3; ++mode) {  // serial, worker threads, walking the index file
+        MzLoader::LoadOptions options;
+        options.num_threads = mode == 1 ? 3 : 1;
+        options.use_index_file = mode == 2;
+        MzLoader nested_loader("small_nested.mzXML", options);
+        vector<unsigned> scans;
+        for (auto& expected : flat_spectra) {  // in file order, nested scans right after their parent
+            ASSERT_TRUE(nested_loader.LoadNext(nested_spectrum));
+            EXPECT_EQ(expected.scan_num, nested_spectrum.scan_num);
+            EXPECT_TRUE(expected.peaks == nested_spectrum.peaks);
+        }
+        EXPECT_FALSE(nested_loader.LoadNext(nested_spectrum));
+        ASSERT_TRUE(nested_loader.LoadScan(11, nested_spectrum));
+        EXPECT_EQ(4u, nested_spectrum.precursor_charge);
+    }
+    remove("small_nested.mzXML.mzlidx");
+}
+
+TEST(Unittest_MzLoader, Filter) {
+    for (std::string filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        vector<MzLoader::Spectrum> all_spectra;
+        MzLoader all_loader(filename.c_str());
+        MzLoader::Spectrum spectrum;
+        while (all_loader.LoadNext(spectrum)) { all_spectra.push_back(spectrum); }
+        ASSERT_EQ(10u, all_spectra.size());
+
+        MzLoader::Filter filter;
+        filter.min_charge = 3;
+        filter.min_precursor_mass = 1000;
+        filter.max_precursor_mass = 6000;
+        filter.max_scan_num = 18;
+        vector<unsigned> expected_scans;
+        for (auto& accepted : all_spectra) {
+            auto mass = (accepted.precursor_mz - 1.007276) * accepted.precursor_charge;
+            if (accepted.precursor_charge >= 3 && 1000 <= mass && mass <= 6000 && accepted.scan_num <= 18) {
+                expected_scans.push_back(accepted.scan_num);
+            }
+        }
+        ASSERT_FALSE(expected_scans.empty());
+        ASSERT_LT(expected_scans.size(), all_spectra.size());
+        for (int mode = 0; mode < 3; ++mode) {  // serial, worker threads, walking the index file
+            MzLoader::LoadOptions options;
+            options.filter = filter;
+            options.num_threads = mode == 1 ? 3 : 1;
+            options.use_index_file = mode == 2;
+            MzLoader loader(filename.c_str(), options);
+            vector<unsigned> scans;
+            while (loader.LoadNext(spectrum)) { scans.push_back(spectrum.scan_num); }
+            EXPECT_EQ(expected_scans, scans);
+            EXPECT_FALSE(loader.LoadScan(all_spectra.back().scan_num, spectrum));  // past max_scan_num
+        }
+        remove((filename + ".mzlidx").c_str());
+
+        for (int mode = 0; mode < 3; ++mode) {  // ms1 spectra, which have no precursor
+            MzLoader::LoadOptions options;
+            options.filter.ms_level = 1;
+            options.num_threads = mode == 1 ? 3 : 1;
+            options.use_index_file = mode == 2;
+            MzLoader ms1_loader(filename.c_str(), options);
+            vector<unsigned> scans;
+            while (ms1_loader.LoadNext(spectrum)) {
+                scans.push_back(spectrum.scan_num);
+                EXPECT_EQ(1u, spectrum.ms_level);
+                EXPECT_EQ(0u, spectrum.precursor_charge);
+                EXPECT_EQ(0.0, spectrum.precursor_mz);
+                EXPECT_FALSE(spectrum.peaks.empty());
+            }
+            EXPECT_EQ(vector<unsigned>({1, 2, 8, 9, 15, 16}), scans);
+            EXPECT_TRUE(ms1_loader.LoadScan(8, spectrum));
+            EXPECT_FALSE(ms1_loader.LoadScan(3, spectrum));  // ms2
+            options.filter.min_charge = 1;
+            MzLoader charged_loader(filename.c_str(), options);
+            EXPECT_FALSE(charged_loader.LoadNext(spectrum));
+        }
+        remove((filename + ".mzlidx").c_str());
+    }
+}
+
+// the peak checks of the filter, one after the other
+static vector<std::pair<double, double>> FilterPeaksByHand(const vector<std::pair<double, double>>& peaks,
+                                                           const MzLoader::Filter& filter) {
+    vector<std::pair<double, double>> kept;
+    for (auto& peak : peaks) {
+        if (filter.min_mz <= peak.first && peak.first <= filter.max_mz && peak.second >= filter.min_intensity) {
+            kept.push_back(peak);
+        }
+    }
+    if (filter.top_n != 0 && kept.size() > filter.top_n) {
+        vector<size_t> order(kept.size());
+        for (size_t i = 0; i < order.size(); ++i) { order[i] = i; }
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return kept[a].second > kept[b].second; });
+        order.resize(filter.top_n);
+        std::sort(order.begin(), order.end());
+        vector<std::pair<double, double>> top;
+        for (auto i : order) { top.push_back(kept[i]); }
+        kept.swap(top);
+    }
+    return kept;
+}
+
+TEST(Unittest_MzLoader, PeakFilter) {
+    vector<MzLoader::Filter> filters(4);
+    filters[0].min_mz = 400;
+    filters[0].max_mz = 900.5;
+    filters[1].min_intensity = 1000;
+    filters[2].top_n = 50;
+    filters[3].min_mz = 300;
+    filters[3].min_intensity = 100;
+    filters[3].top_n = 20;
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        for (auto& filter : filters) {
+            for (unsigned num_threads : {1u, 2u}) {
+                MzLoader::LoadOptions options;
+                options.filter = filter;
+                options.num_threads = num_threads;
+                MzLoader all_loader(filename);
+                MzLoader pair_loader(filename, options);
+                MzLoader view_loader(filename, options);
+                MzLoader::Spectrum all, pairs;
+                MzLoader::SpectrumView view;
+                while (all_loader.LoadNext(all)) {
+                    auto expected = FilterPeaksByHand(all.peaks, filter);
+                    ASSERT_LT(expected.size(), all.peaks.size());
+                    ASSERT_TRUE(pair_loader.LoadNext(pairs));
+                    EXPECT_TRUE(expected == pairs.peaks);
+                    ASSERT_TRUE(view_loader.LoadNext(view));
+                    ASSERT_EQ(expected.size(), view.size);
+                    for (size_t i = 0; i < view.size; ++i) {
+                        EXPECT_EQ(expected[i].first, view.mz[i * view.stride]);
+                        EXPECT_EQ(expected[i].second, view.intensity[i * view.stride]);
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, ReusePeaksCapacity) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        MzLoader loader(filename);
+        MzLoader::Spectrum spectrum;
+        spectrum.peaks.reserve(100000);  // more than any spectrum in the file
+        auto peaks_data = spectrum.peaks.data();
+        while (loader.LoadNext(spectrum)) {
+            EXPECT_EQ(peaks_data, spectrum.peaks.data());  // filled in place, never reallocated
+            EXPECT_FALSE(spectrum.peaks.empty());
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, ArrayLayout) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        for (unsigned num_threads : {1u, 3u}) {
+            MzLoader::LoadOptions options;
+            options.num_threads = num_threads;
+            MzLoader pair_loader(filename);
+            MzLoader double_loader(filename, options);
+            MzLoader float_loader(filename, options);
+            MzLoader::Spectrum pairs;
+            MzLoader::SpectrumArrays<double> doubles;
+            MzLoader::SpectrumArrays<double, float> floats;
+            while (pair_loader.LoadNext(pairs)) {
+                ASSERT_TRUE(double_loader.LoadNext(doubles));
+                ASSERT_TRUE(float_loader.LoadNext(floats));
+                EXPECT_EQ(pairs.scan_num, doubles.scan_num);
+                EXPECT_EQ(pairs.precursor_charge, floats.precursor_charge);
+                EXPECT_EQ(pairs.file_offset, floats.file_offset);
+                ASSERT_EQ(pairs.peaks.size(), doubles.mz.size());
+                ASSERT_EQ(pairs.peaks.size(), floats.intensity.size());
+                for (size_t i = 0; i < pairs.peaks.size(); ++i) {
+                    EXPECT_EQ(pairs.peaks[i].first, doubles.mz[i]);
+                    EXPECT_EQ(pairs.peaks[i].second, doubles.intensity[i]);
+                    EXPECT_EQ(pairs.peaks[i].first, floats.mz[i]);
+                    EXPECT_EQ(static_cast<float>(pairs.peaks[i].second), floats.intensity[i]);
+                }
+            }
+            EXPECT_FALSE(double_loader.LoadNext(doubles));
+        }
+        MzLoader loader(filename);
+        MzLoader::SpectrumArrays<float> floats;
+        ASSERT_TRUE(loader.LoadScan(11, floats));
+        EXPECT_EQ(4u, floats.precursor_charge);
+        EXPECT_FALSE(floats.mz.empty());
+    }
+}
+
+TEST(Unittest_MzLoader, SpectrumView) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        for (unsigned num_threads : {1u, 3u}) {
+            MzLoader::LoadOptions options;
+            options.num_threads = num_threads;
+            MzLoader pair_loader(filename);
+            MzLoader view_loader(filename, options);
+            MzLoader::Spectrum pairs;
+            MzLoader::SpectrumView view;
+            while (pair_loader.LoadNext(pairs)) {
+                ASSERT_TRUE(view_loader.LoadNext(view));
+                EXPECT_EQ(pairs.scan_num, view.scan_num);
+                ASSERT_EQ(pairs.peaks.size(), view.size);
+                for (size_t i = 0; i < view.size; ++i) {
+                    EXPECT_EQ(pairs.peaks[i].first, view.mz[i * view.stride]);
+                    EXPECT_EQ(pairs.peaks[i].second, view.intensity[i * view.stride]);
+                }
+            }
+            EXPECT_FALSE(view_loader.LoadNext(view));
+        }
+        MzLoader loader(filename);
+        MzLoader::Spectrum pairs;
+        MzLoader::SpectrumView view;
+        ASSERT_TRUE(loader.LoadScan(11, pairs));
+        ASSERT_TRUE(loader.LoadScan(11, view));
+        ASSERT_EQ(pairs.peaks.size(), view.size);
+        EXPECT_EQ(pairs.peaks.back().second, view.intensity[(view.size - 1) * view.stride]);
+    }
+}
+
+TEST(Unittest_MzLoader, Cache) {
+    for (std::string filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        auto cache_filename = filename + ".mzlcache";
+        MzLoader::WriteCache(filename.c_str(), cache_filename.c_str());
+        MzLoader source_loader(filename.c_str());
+        MzLoader cache_loader(cache_filename.c_str());
+        MzLoader view_loader(cache_filename.c_str());
+        MzLoader::Spectrum source, cached;
+        MzLoader::SpectrumView view;
+        while (source_loader.LoadNext(source)) {
+            ASSERT_TRUE(cache_loader.LoadNext(cached));
+            ASSERT_TRUE(view_loader.LoadNext(view));
+            EXPECT_EQ(source.scan_num, cached.scan_num);
+            EXPECT_EQ(source.precursor_charge, cached.precursor_charge);
+            EXPECT_EQ(source.precursor_mz, cached.precursor_mz);
+            EXPECT_EQ(source.total_ion_current, cached.total_ion_current);
+            EXPECT_EQ(source.file_offset, cached.file_offset);
+            EXPECT_TRUE(source.peaks == cached.peaks);
+            ASSERT_EQ(source.peaks.size(), view.size);
+            for (size_t i = 0; i < view.size; ++i) {
+                EXPECT_EQ(source.peaks[i].first, view.mz[i * view.stride]);
+                EXPECT_EQ(source.peaks[i].second, view.intensity[i * view.stride]);
+            }
+        }
+        EXPECT_FALSE(cache_loader.LoadNext(cached));
+        EXPECT_FALSE(view_loader.LoadNext(view));
+        ASSERT_TRUE(cache_loader.LoadScan(11, cached));
+        EXPECT_EQ(4u, cached.precursor_charge);
+        EXPECT_FALSE(cache_loader.LoadScan(1000, cached));
+
+        MzLoader scan_loader(cache_filename.c_str());  // the first LoadScan calls race to build the scan table
+        std::vector<std::thread> threads;
+        for (unsigned scan_num : {3u, 11u, 14u, 1000u}) {
+            threads.emplace_back([&scan_loader, scan_num] {
+                MzLoader::Spectrum spectrum;
+                EXPECT_EQ(scan_num != 1000, scan_loader.LoadScan(scan_num, spectrum));
+                if (scan_num != 1000) { EXPECT_EQ(scan_num, spectrum.scan_num); }
+            });
+        }
+        for (auto& thread : threads) { thread.join(); }
+
+        MzLoader::LoadOptions options;  // the filter of the loader applies to the cache
+        options.filter.min_charge = 3;
+        options.filter.min_mz = 400;
+        options.filter.top_n = 5;
+        MzLoader filtered_source_loader(filename.c_str(), options);
+        MzLoader filtered_cache_loader(cache_filename.c_str(), options);
+        while (filtered_source_loader.LoadNext(source)) {
+            ASSERT_TRUE(filtered_cache_loader.LoadNext(cached));
+            EXPECT_EQ(source.scan_num, cached.scan_num);
+            EXPECT_TRUE(source.peaks == cached.peaks);
+        }
+        EXPECT_FALSE(filtered_cache_loader.LoadNext(cached));
+
+        // recognized by its content, not its name
+        auto renamed_filename = filename + ".cache.mzML";
+        rename(cache_filename.c_str(), renamed_filename.c_str());
+        MzLoader renamed_loader(renamed_filename.c_str());
+        EXPECT_TRUE(renamed_loader.LoadNext(cached));
+        EXPECT_EQ(3u, cached.scan_num);
+        remove(renamed_filename.c_str());
+    }
+
+    // a truncated or corrupted cache is refused when it is opened
+    MzLoader::WriteCache("small_charge.mzML", "small_charge.mzlcache");
+    std::ifstream cache_file("small_charge.mzlcache", std::ios::binary);
+    const std::string cache_text((std::istreambuf_iterator<char>(cache_file)), std::istreambuf_iterator<char>());
+    cache_file.close();
+    remove("small_charge.mzlcache");
+    CacheHeader header;
+    memcpy(&header, cache_text.data(), sizeof(header));
+    ASSERT_LT(2u, header.spectrum_count);
+    auto write_broken_cache = [&](const std::string& text) {
+        std::ofstream("broken.mzlcache", std::ios::binary) << text;
+    };
+    auto with_header = [&](const CacheHeader& broken_header) {
+        auto text = cache_text;
+        memcpy(&text[0], &broken_header, sizeof(broken_header));
+        return text;
+    };
+    write_broken_cache(cache_text.substr(0, cache_text.size() - 8));  // without the total of the peak starts
+    EXPECT_THROW(MzLoader("broken.mzlcache"), std::runtime_error);
+    auto broken_header = header;
+    broken_header.spectrum_count = std::numeric_limits<uint64_t>::max() / sizeof(CacheEntry) + 2;  // sizes overflow
+    write_broken_cache(with_header(broken_header));
+    EXPECT_THROW(MzLoader("broken.mzlcache"), std::runtime_error);
+    broken_header = header;
+    broken_header.mz_offset = std::numeric_limits<uint64_t>::max() - 7;  // offset + size overflows
+    write_broken_cache(with_header(broken_header));
+    EXPECT_THROW(MzLoader("broken.mzlcache"), std::runtime_error);
+    broken_header = header;
+    broken_header.entries_offset += 4;  // entries read in place must be aligned
+    write_broken_cache(with_header(broken_header));
+    EXPECT_THROW(MzLoader("broken.mzlcache"), std::runtime_error);
+    auto text = cache_text;  // a spectrum starting past the next one, total intact
+    uint64_t past_the_end = header.peak_count + 1000;
+    memcpy(&text[header.peak_starts_offset + sizeof(uint64_t)], &past_the_end, sizeof(past_the_end));
+    write_broken_cache(text);
+    EXPECT_THROW(MzLoader("broken.mzlcache"), std::runtime_error);
+    write_broken_cache(cache_text);  // the intact cache still opens
+    MzLoader intact_loader("broken.mzlcache");
+    MzLoader::Spectrum spectrum;
+    EXPECT_TRUE(intact_loader.LoadNext(spectrum));
+    remove("broken.mzlcache");
+}
+
+TEST(Unittest_MzLoader, LoadNextHeader) {
+    for (std::string filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        auto cache_filename = filename + ".mzlcache";
+        MzLoader::WriteCache(filename.c_str(), cache_filename.c_str());
+        for (auto header_filename : {filename, cache_filename}) {
+            for (unsigned num_threads : {1u, 3u}) {
+                for (bool is_loaded_first : {false, true}) {  // header passes do not depend on LoadNext
+                    MzLoader::LoadOptions options;
+                    options.num_threads = num_threads;
+                    options.filter.min_charge = 3;
+                    options.filter.top_n = 5;  // does not change the stated count
+                    MzLoader loader(filename.c_str());
+                    MzLoader header_loader(header_filename.c_str(), options);
+                    MzLoader::Spectrum spectrum;
+                    MzLoader::SpectrumSummary summary;
+                    if (is_loaded_first) {  // with worker threads, this starts them
+                        ASSERT_TRUE(header_loader.LoadNext(spectrum));
+                        ASSERT_TRUE(header_loader.LoadNext(spectrum));
+                    }
+                    while (loader.LoadNext(spectrum)) {
+                        if (spectrum.precursor_charge < 3) { continue; }
+                        ASSERT_TRUE(header_loader.LoadNextHeader(summary));
+                        EXPECT_EQ(spectrum.scan_num, summary.scan_num);
+                        EXPECT_EQ(spectrum.precursor_mz, summary.precursor_mz);
+                        EXPECT_EQ(spectrum.total_ion_current, summary.total_ion_current);
+                        EXPECT_EQ(spectrum.peaks.size(), summary.peak_count);
+                    }
+                    EXPECT_FALSE(header_loader.LoadNextHeader(summary));
+                }
+            }
+        }
+        remove(cache_filename.c_str());
+    }
+
+    // without defaultArrayLength the peaks are decoded and counted
+    MzLoader reference_loader("small_charge.mzML");
+    MzLoader::Spectrum reference;
+    ASSERT_TRUE(reference_loader.LoadScan(11, reference));
+    vector<unsigned char> mz_bytes, intensity_bytes;
+    for (auto& peak : reference.peaks) {
+        auto mz = reinterpret_cast<const unsigned char*>(&peak.first);
+        auto intensity = reinterpret_cast<const unsigned char*>(&peak.second);
+        mz_bytes.insert(mz_bytes.end(), mz, mz + sizeof(double));
+        intensity_bytes.insert(intensity_bytes.end(), intensity, intensity + sizeof(double));
+    }
+    WriteSpectrumMzml("no_length.mzML", 11, "",
+                      BinaryDataArray("64-bit float\0no compression\0", "m/z array", mz_bytes)
+                      + BinaryDataArray("64-bit float\0no compression\0", "intensity array", intensity_bytes));
+    MzLoader loader("no_length.mzML");
+    MzLoader::SpectrumSummary summary;
+    ASSERT_TRUE(loader.LoadNextHeader(summary));
+    EXPECT_EQ(reference.peaks.size(), summary.peak_count);
+    remove("no_length.mzML");
+
+    // the arrays are checked as for decoding, even with a stated count
+    auto mz_array = BinaryDataArray("64-bit float\0no compression\0", "m/z array", mz_bytes);
+    auto intensity_array = BinaryDataArray("64-bit float\0no compression\0", "intensity array", intensity_bytes);
+    auto length = " defaultArrayLength=\"" + std::to_string(reference.peaks.size()) + "\"";
+    const struct { std::string arrays; bool is_valid; } cases[] = {
+        {mz_array + intensity_array, true},
+        {mz_array, false},  // no intensity array
+        {mz_array + BinaryDataArray("64-bit float\0", "intensity array", intensity_bytes), false},  // no compression term
+        {mz_array + BinaryDataArray("16-bit float\0no compression\0", "intensity array", intensity_bytes), false},
+    };
+    for (auto& array_case : cases) {
+        WriteSpectrumMzml("stated_length.mzML", 11, "", array_case.arrays, length);
+        MzLoader spectrum_loader("stated_length.mzML");
+        MzLoader header_loader("stated_length.mzML");
+        MzLoader::Spectrum spectrum;
+        EXPECT_EQ(array_case.is_valid, spectrum_loader.LoadNext(spectrum));
+        EXPECT_EQ(array_case.is_valid, header_loader.LoadNextHeader(summary));
+    }
+    remove("stated_length.mzML");
+
+    // and in mzXML, here with a compression that is not supported
+    std::ifstream mzxml_file("small_charge.mzXML", std::ios::binary);
+    std::string mzxml_text((std::istreambuf_iterator<char>(mzxml_file)), std::istreambuf_iterator<char>());
+    auto peaks_start = mzxml_text.find("compressionType=\"zlib\"", mzxml_text.find("<scan num=\"3\""));
+    mzxml_text.replace(peaks_start, 23, "compressionType=\"lzma\"");
+    std::ofstream("unsupported.mzXML", std::ios::binary) << mzxml_text;
+    MzLoader spectrum_loader("unsupported.mzXML");
+    MzLoader header_loader("unsupported.mzXML");
+    MzLoader::Spectrum spectrum;
+    while (spectrum_loader.LoadNext(spectrum)) {
+        ASSERT_TRUE(header_loader.LoadNextHeader(summary));
+        EXPECT_EQ(spectrum.scan_num, summary.scan_num);  // scan 3 is skipped by both
+    }
+    EXPECT_FALSE(header_loader.LoadNextHeader(summary));
+    remove("unsupported.mzXML");
+}
+
+TEST(Unittest_MzLoader, PrecursorIndex) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        vector<MzLoader::Spectrum> all_spectra;
+        MzLoader all_loader(filename);
+        MzLoader::Spectrum spectrum;
+        while (all_loader.LoadNext(spectrum)) { all_spectra.push_back(spectrum); }
+        auto mass_of = [](const MzLoader::Spectrum& s) { return (s.precursor_mz - 1.007276) * s.precursor_charge; };
+
+        PrecursorIndex index(filename);
+        ASSERT_EQ(all_spectra.size(), index.size());
+        for (size_t i = 1; i < index.size(); ++i) { EXPECT_LE(index[i - 1].precursor_mass, index[i].precursor_mass); }
+        auto middle_mass = index[index.size() / 2].precursor_mass;
+        for (double tolerance : {0.0, 100.0, 1000.0}) {
+            vector<unsigned> expected_scans;
+            for (auto& s : all_spectra) {
+                if (std::fabs(mass_of(s) - middle_mass) <= tolerance) { expected_scans.push_back(s.scan_num); }
+            }
+            auto range = index.Find(middle_mass - tolerance, middle_mass + tolerance);
+            vector<unsigned> scans;
+            MzLoader loader(filename);
+            for (auto entry = range.first; entry != range.second; ++entry) {
+                ASSERT_TRUE(loader.LoadScan(entry->scan_num, spectrum));
+                EXPECT_EQ(entry->precursor_charge, spectrum.precursor_charge);
+                EXPECT_EQ(entry->file_offset, spectrum.file_offset);
+                EXPECT_DOUBLE_EQ(entry->precursor_mass, mass_of(spectrum));
+                scans.push_back(spectrum.scan_num);
+            }
+            std::sort(expected_scans.begin(), expected_scans.end());
+            std::sort(scans.begin(), scans.end());
+            EXPECT_EQ(expected_scans, scans);
+        }
+        auto empty = index.Find(-2, -1);
+        EXPECT_EQ(empty.first, empty.second);
+
+        MzLoader::LoadOptions options;  // the spectrum checks of the filter apply
+        options.filter.min_charge = 3;
+        PrecursorIndex charge_index(filename, options);
+        for (size_t i = 0; i < charge_index.size(); ++i) { EXPECT_LE(3u, charge_index[i].precursor_charge); }
+        EXPECT_LT(charge_index.size(), index.size());
+    }
+}
+
+TEST(Unittest_MzLoader, LoadBatch) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        vector<MzLoader::Spectrum> all_spectra;
+        MzLoader all_loader(filename);
+        MzLoader::Spectrum spectrum;
+        while (all_loader.LoadNext(spectrum)) { all_spectra.push_back(spectrum); }
+        for (unsigned num_threads : {1u, 3u}) {
+            MzLoader::LoadOptions options;
+            options.num_threads = num_threads;
+            MzLoader loader(filename, options);
+            MzLoader::SpectrumBatch batch;
+            size_t loaded = 0;
+            while (auto count = loader.LoadBatch(4, batch)) {
+                ASSERT_EQ(count, batch.headers.size());
+                ASSERT_EQ(count + 1, batch.peak_starts.size());
+                EXPECT_EQ(batch.mz.size(), batch.peak_starts.back());
+                EXPECT_EQ(batch.intensity.size(), batch.peak_starts.back());
+                for (size_t i = 0; i < count; ++i) {
+                    auto& expected = all_spectra[loaded + i];
+                    EXPECT_EQ(expected.scan_num, batch.headers[i].scan_num);
+                    ASSERT_EQ(expected.peaks.size(), batch.peak_starts[i + 1] - batch.peak_starts[i]);
+                    for (size_t j = 0; j < expected.peaks.size(); ++j) {
+                        EXPECT_EQ(expected.peaks[j].first, batch.mz[batch.peak_starts[i] + j]);
+                        EXPECT_EQ(expected.peaks[j].second, batch.intensity[batch.peak_starts[i] + j]);
+                    }
+                }
+                loaded += count;
+            }
+            EXPECT_EQ(all_spectra.size(), loaded);  // the last batch holds the 2 that are left
+            EXPECT_TRUE(batch.headers.empty());
+            EXPECT_EQ(1u, batch.peak_starts.size());
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, Iterator) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        vector<MzLoader::Spectrum> all_spectra;
+        MzLoader all_loader(filename);
+        MzLoader::Spectrum spectrum;
+        while (all_loader.LoadNext(spectrum)) { all_spectra.push_back(spectrum); }
+
+        MzLoader loader(filename);
+        size_t i = 0;
+        for (auto& iterated : loader) {
+            ASSERT_LT(i, all_spectra.size());
+            EXPECT_EQ(all_spectra[i].scan_num, iterated.scan_num);
+            EXPECT_TRUE(all_spectra[i].peaks == iterated.peaks);
+            ++i;
+        }
+        EXPECT_EQ(all_spectra.size(), i);
+        EXPECT_TRUE(loader.begin() == loader.end());
+
+        // keep the charge 4 spectra, moving them out of the buffer
+        MzLoader keep_loader(filename);
+        ASSERT_TRUE(keep_loader.LoadNext(spectrum));  // begin() goes on from here
+        vector<MzLoader::Spectrum> kept;
+        for (auto it = keep_loader.begin(); it != keep_loader.end(); ++it) {
+            if (it->precursor_charge != 4) { continue; }
+            auto peaks = it->peaks.data();
+            kept.push_back(std::move(*it));
+            EXPECT_EQ(peaks, kept.back().peaks.data());  // not copied
+        }
+        vector<unsigned> expected_scans, kept_scans;
+        for (size_t j = 1; j < all_spectra.size(); ++j) {
+            if (all_spectra[j].precursor_charge == 4) { expected_scans.push_back(all_spectra[j].scan_num); }
+        }
+        for (auto& k : kept) { kept_scans.push_back(k.scan_num); }
+        EXPECT_FALSE(expected_scans.empty());
+        EXPECT_EQ(expected_scans, kept_scans);
+    }
+}
+
+// places the spectra in the rows of a matrix, one row per spectrum
+class MatrixVisitor : public MzLoader::Visitor {
+public:
+    MatrixVisitor(size_t rows, size_t row_size) : row_size_(row_size), mz_(rows * row_size), intensity_(rows * row_size) {}
+
+    MzLoader::PeakSink Place(const MzLoader::SpectrumHeader& header) override {
+        placed_headers_.push_back(header);
+        return MzLoader::PeakSink{&mz_[headers_.size() * row_size_], &intensity_[headers_.size() * row_size_], row_size_};
+    }
+
+    void Discard(const MzLoader::SpectrumHeader& header) override { discarded_headers_.push_back(header); }
+
+    void Visit(const MzLoader::SpectrumHeader& header, size_t peak_count, size_t kept_count) override {
+        headers_.push_back(header);
+        peak_counts_.push_back(peak_count);
+        kept_counts_.push_back(kept_count);
+    }
+
+    vector<std::pair<double, double>> Peaks(size_t row) const {
+        vector<std::pair<double, double>> peaks;
+        for (size_t i = 0; i < peak_counts_[row]; ++i) {
+            peaks.emplace_back(mz_[row * row_size_ + i], intensity_[row * row_size_ + i]);
+        }
+        return peaks;
+    }
+
+    vector<MzLoader::SpectrumHeader> placed_headers_;
+    vector<MzLoader::SpectrumHeader> discarded_headers_;
+    vector<MzLoader::SpectrumHeader> headers_;
+    vector<size_t> peak_counts_;
+    vector<size_t> kept_counts_;
+
+private:
+    size_t row_size_;
+    vector<double> mz_, intensity_;
+};
+
+TEST(Unittest_MzLoader, ForEach) {
+    for (std::string filename : {"small_charge.mzML", "small_charge.mzXML"}) {
+        auto cache_filename = filename + ".mzlcache";
+        MzLoader::WriteCache(filename.c_str(), cache_filename.c_str());
+        for (auto visit_filename : {filename, cache_filename}) {
+            for (int mode = 0; mode < 3; ++mode) {  // plain, worker threads, peak filter
+                MzLoader::LoadOptions options;
+                options.num_threads = mode == 1 ? 3 : 1;
+                if (mode == 2) {
+                    options.filter.min_mz = 400;
+                    options.filter.max_mz = 1200;
+                    options.filter.top_n = 20;
+                }
+                MzLoader loader(filename.c_str(), options);
+                MzLoader visit_loader(visit_filename.c_str(), options);
+                MatrixVisitor visitor(10, 4096);
+                EXPECT_EQ(10u, visit_loader.ForEach(visitor));
+                MzLoader::Spectrum spectrum;
+                for (size_t row = 0; loader.LoadNext(spectrum); ++row) {
+                    ASSERT_LT(row, visitor.headers_.size());
+                    EXPECT_EQ(spectrum.scan_num, visitor.headers_[row].scan_num);
+                    EXPECT_EQ(spectrum.file_offset, visitor.headers_[row].file_offset);
+                    ASSERT_LT(row, visitor.placed_headers_.size());  // the header is complete when placed
+                    EXPECT_EQ(spectrum.scan_num, visitor.placed_headers_[row].scan_num);
+                    EXPECT_EQ(spectrum.file_offset, visitor.placed_headers_[row].file_offset);
+                    EXPECT_EQ(spectrum.precursor_mz, visitor.placed_headers_[row].precursor_mz);
+                    EXPECT_TRUE(spectrum.peaks == visitor.Peaks(row));
+                }
+            }
+        }
+        remove(cache_filename.c_str());
+
+        // rows narrower than the spectra keep as many as fit, top_n picks which
+        MzLoader::LoadOptions options;
+        options.filter.top_n = 5;
+        MzLoader loader(filename.c_str());
+        MzLoader visit_loader(filename.c_str());
+        MatrixVisitor visitor(10, 5);
+        visit_loader.ForEach(visitor);
+        MzLoader::Spectrum spectrum;
+        for (size_t row = 0; loader.LoadNext(spectrum); ++row) {
+            EXPECT_EQ(5u, visitor.peak_counts_[row]);
+            EXPECT_EQ(spectrum.peaks.size(), visitor.kept_counts_[row]);  // tells a truncated spectrum from a short one
+        }
+        MzLoader top_loader(filename.c_str(), options);
+        MatrixVisitor top_visitor(10, 5);
+        top_loader.ForEach(top_visitor);
+        MzLoader top_reference(filename.c_str(), options);
+        for (size_t row = 0; top_reference.LoadNext(spectrum); ++row) {
+            EXPECT_TRUE(spectrum.peaks == top_visitor.Peaks(row));
+            EXPECT_EQ(5u, top_visitor.kept_counts_[row]);
+        }
+    }
+
+    // a spectrum whose arrays differ in length is dropped after its place was
+    // asked for, and is discarded before the next one is placed
+    auto bytes = [](const vector<double>& values) {
+        auto data = reinterpret_cast<const unsigned char*>(values.data());
+        return vector<unsigned char>(data, data + values.size() * sizeof(double));
+    };
+    auto mz_array = BinaryDataArray("64-bit float\0no compression\0", "m/z array", bytes(vector<double>{1, 2, 3}));
+    auto short_intensity_array = BinaryDataArray("64-bit float\0no compression\0", "intensity array",
+                                                 bytes(vector<double>{4, 5}));
+    auto intensity_array = BinaryDataArray("64-bit float\0no compression\0", "intensity array",
+                                           bytes(vector<double>{4, 5, 6}));
+    for (bool is_broken_last : {false, true}) {
+        std::ofstream("discard.mzML")
+                << "<mzML><run><spectrumList>"
+                << SpectrumMzml(1, "", mz_array + (is_broken_last ? intensity_array : short_intensity_array))
+                << SpectrumMzml(2, "", mz_array + (is_broken_last ? short_intensity_array : intensity_array))
+                << "</spectrumList></run></mzML>";
+        MzLoader loader("discard.mzML");
+        MatrixVisitor visitor(2, 3);
+        EXPECT_EQ(1u, loader.ForEach(visitor));
+        ASSERT_EQ(2u, visitor.placed_headers_.size());
+        ASSERT_EQ(1u, visitor.discarded_headers_.size());
+        ASSERT_EQ(1u, visitor.headers_.size());
+        auto broken_scan_num = is_broken_last ? 2u : 1u;
+        EXPECT_EQ(broken_scan_num, visitor.discarded_headers_[0].scan_num);
+        EXPECT_EQ(3u - broken_scan_num, visitor.headers_[0].scan_num);
+        EXPECT_EQ(3u, visitor.peak_counts_[0]);
+        EXPECT_EQ(3u, visitor.kept_counts_[0]);
+        EXPECT_TRUE((vector<std::pair<double, double>>{{1, 4}, {2, 5}, {3, 6}}) == visitor.Peaks(0));
+    }
+    remove("discard.mzML");
+}
+
+TEST(Unittest_MzLoader, ConcurrentLoader) {
+    for (auto filename : {"small_charge.mzML", "small_charge.mzXML", "small_nested.mzXML"}) {
+        std::vector<MzLoader::Spectrum> serial_spectra;
+        MzLoader serial_loader(filename);
+        MzLoader::Spectrum spectrum;
+        while (serial_loader.LoadNext(spectrum)) { serial_spectra.push_back(spectrum); }
+        for (bool ordered_delivery : {true, false}) {
+            MzLoader::LoadOptions options;
+            options.num_threads = 3;
+            options.ordered_delivery = ordered_delivery;
+            ConcurrentMzLoader loader(filename, options);
+            std::vector<MzLoader::Spectrum> spectra;
+            std::mutex spectra_mutex;
+            std::vector<std::thread> consumers;
+            for (int i = 0; i < 4; ++i) {
+                consumers.emplace_back([&] {
+                    MzLoader::Spectrum buffer;
+                    while (loader.LoadNext(buffer)) {
+                        std::lock_guard<std::mutex> lock(spectra_mutex);
+                        spectra.push_back(buffer);
+                    }
+                });
+                consumers.emplace_back([&] {  // one that takes batches
+                    MzLoader::SpectrumBatch batch;
+                    while (auto count = loader.LoadBatch(2, batch)) {
+                        std::lock_guard<std::mutex> lock(spectra_mutex);
+                        for (size_t j = 0; j < count; ++j) {
+                            MzLoader::Spectrum buffer;
+                            static_cast<MzLoader::SpectrumHeader&>(buffer) = batch.headers[j];
+                            for (auto k = batch.peak_starts[j]; k < batch.peak_starts[j + 1]; ++k) {
+                                buffer.peaks.emplace_back(batch.mz[k], batch.intensity[k]);
+                            }
+                            spectra.push_back(buffer);
+                        }
+                    }
+                });
+            }
+            for (auto& consumer : consumers) { consumer.join(); }
+            std::sort(spectra.begin(), spectra.end(), [](const MzLoader::Spectrum& a, const MzLoader::Spectrum& b) {
+                return a.file_offset < b.file_offset;
+            });
+            ASSERT_EQ(serial_spectra.size(), spectra.size());
+            for (size_t i = 0; i < spectra.size(); ++i) {
+                EXPECT_EQ(serial_spectra[i].file_offset, spectra[i].file_offset);
+                EXPECT_EQ(serial_spectra[i].scan_num, spectra[i].scan_num);
+                EXPECT_TRUE(serial_spectra[i].peaks == spectra[i].peaks);
+            }
+        }
+    }
+}
+
+TEST(Unittest_MzLoader, FindAllStartTags) {
+    std::string text(20 * 1024 * 1024, 'A');  // large enough to be split across threads
+    std::vector<size_t> expected_offsets;
+    for (size_t offset = 7; offset + 64 < text.size(); offset += 4194297) {  // also lands on range boundaries
+        text.replace(offset, 11, "<scan num=\"");
+        text.replace(offset + 20, 10, "<scanList>");  // must not match
+        expected_offsets.push_back(offset);
+    }
+    for (unsigned num_threads : {1u, 3u, 8u}) {
+        EXPECT_EQ(expected_offsets, FindAllStartTags(text.data(), text.size(), "scan", num_threads));
+    }
+}
+
 // To test all paths, there are 2^3 settings of input format.
 // Please try a validation before using this library.
 // All little endian settings are tested.
\ No newline at end of file